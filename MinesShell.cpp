@@ -10,6 +10,7 @@
 #include <sstream> // Allows string stream operations, useful for parsing.
 #include <unistd.h> // Provides access to the POSIX operating system API.
 #include <sys/wait.h> // Provides declarations for waiting for process termination.
+#include <sys/resource.h>
 #include <sys/stat.h> // Defines the structure of the data returned by the stat() function.
 #include <cstdlib> // Defines several general-purpose functions, including memory management, random number generation, and system commands.
 #include <iterator>
@@ -18,414 +19,5894 @@
 #include <algorithm>
 #include <fstream>
 #include <cctype>
+#include <cerrno>
+#include <spawn.h> // Provides posix_spawn and its file actions.
+#include <unordered_map>
+#include <set>
+#include <csignal>
+#include <ctime>
+#include <termios.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <functional>
+#include <deque>
+#include <chrono>
+#include <sys/ioctl.h>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <string_view>
+#include <climits>
+#include <dirent.h>
+#include <bitset>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MISH_X86_SIMD 1 // The lexer scans with SSE2, and with AVX2 when the CPU supports it.
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+extern char** environ; // The environment the shell was started with, imported into its variables.
+
+/**
+ * A bump allocator for data that only lives as long as one command line: lexer tokens, argv
+ * arrays, file actions and pipeline stages. main() resets it before reading each line. Its
+ * blocks are kept across resets, so once warmed up a line costs no heap allocations for these.
+ * Only the main thread allocates from it.
+ */
+struct Arena {
+    vector<pair<unique_ptr<char[]>, size_t>> blocks; // Each block and its capacity.
+    size_t block = 0;  // Index of the block being filled.
+    size_t used = 0;   // Bytes used in that block.
+
+    void* allocate(size_t size, size_t align) {
+        while (true) {
+            if (block < blocks.size()) {
+                size_t start = (used + align - 1) & ~(align - 1);
+                if (start + size <= blocks[block].second) {
+                    used = start + size;
+                    return blocks[block].first.get() + start;
+                }
+                if (block + 1 < blocks.size()) { // Move on to a block kept from an earlier line.
+                    block++;
+                    used = 0;
+                    continue;
+                }
+            }
+            size_t capacity = max(size + align, blocks.empty() ? size_t(64 * 1024) : blocks.back().second * 2);
+            blocks.emplace_back(unique_ptr<char[]>(new char[capacity]), capacity);
+            block = blocks.size() - 1;
+            used = 0;
+        }
+    }
+
+    /**
+     * Copies a string into the arena with a terminating null.
+     */
+    char* copyString(string_view text) {
+        char* copy = static_cast<char*>(allocate(text.size() + 1, 1));
+        memcpy(copy, text.data(), text.size());
+        copy[text.size()] = '\0';
+        return copy;
+    }
+
+    /**
+     * Releases everything allocated since the last reset at once.
+     */
+    void reset() {
+        block = 0;
+        used = 0;
+    }
+};
+
+Arena commandArena; // Scratch memory for the command line being executed.
+
 /**
- * Splits a string into individual words using whitespace as the delimiter.
- * @param str The string to tokenize.
- * @return A vector of tokens (words).
+ * Standard allocator interface over commandArena. Deallocation does nothing; the memory
+ * comes back when the arena is reset.
  */
-vector<string> tokenize(const string& str); // Splits a string into tokens (words) based on whitespace.
+template <class T>
+struct ArenaAllocator {
+    using value_type = T;
+    ArenaAllocator() = default;
+    template <class U> ArenaAllocator(const ArenaAllocator<U>&) {}
+    T* allocate(size_t n) { return static_cast<T*>(commandArena.allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+    template <class U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+    template <class U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+template <class T>
+using ArenaVector = vector<T, ArenaAllocator<T>>;
+
+/**
+ * Allocator for the shell's long-lived tables of jobs and event handlers. Freed single
+ * elements, such as hash map nodes, are kept on a free list and handed out again, so
+ * launching and reaping a job stops allocating once the shell has warmed up. Larger
+ * requests go straight to the heap. Only the main thread uses these tables.
+ */
+template <class T>
+struct RecyclingAllocator {
+    using value_type = T;
+    union FreeBlock {
+        FreeBlock* next;
+        alignas(T) char storage[sizeof(T)];
+    };
+    static FreeBlock*& freeList() {
+        static FreeBlock* head = nullptr;
+        return head;
+    }
+
+    RecyclingAllocator() = default;
+    template <class U> RecyclingAllocator(const RecyclingAllocator<U>&) {}
+    T* allocate(size_t n) {
+        if (n == 1 && freeList()) {
+            FreeBlock* reused = freeList();
+            freeList() = reused->next;
+            return reinterpret_cast<T*>(reused);
+        }
+        return static_cast<T*>(::operator new(n == 1 ? sizeof(FreeBlock) : n * sizeof(T)));
+    }
+    void deallocate(T* pointer, size_t n) {
+        if (n != 1) {
+            ::operator delete(pointer);
+            return;
+        }
+        FreeBlock* freed = reinterpret_cast<FreeBlock*>(pointer);
+        freed->next = freeList();
+        freeList() = freed;
+    }
+    template <class U> bool operator==(const RecyclingAllocator<U>&) const { return true; }
+    template <class U> bool operator!=(const RecyclingAllocator<U>&) const { return false; }
+};
+
+template <class Key, class Value>
+using RecyclingMap = unordered_map<Key, Value, hash<Key>, equal_to<Key>, RecyclingAllocator<pair<const Key, Value>>>;
 
-void executeCommand(const vector<string>& tokens); // Executes a command using the list of string tokens.
 string getCurrentDirectory(); // Returns the current working directory as a string.
-bool isBackgroundCommand(const string& cmd); // Checks if a command should be executed in the background.
-vector<char*> segment_args(const vector<string>& segment) {
-    vector<char*> args;
-    for (const auto& arg : segment) {
-        args.push_back(const_cast<char*>(arg.c_str()));  // Unsafe cast due to constness, but execvp won't modify the strings
+char** segment_args(const vector<string>& segment) {
+    char** args = static_cast<char**>(commandArena.allocate((segment.size() + 1) * sizeof(char*), alignof(char*)));
+    for (size_t i = 0; i < segment.size(); ++i) {
+        args[i] = const_cast<char*>(segment[i].c_str());  // Unsafe cast due to constness, but execvp won't modify the strings
     }
-    args.push_back(nullptr);  // execvp expects a null-terminated array
+    args[segment.size()] = nullptr;  // execvp expects a null-terminated array
     return args;
 }
-vector<string> tokenize(const string& str) {
-    istringstream iss(str); // Creates a string stream from the input string.
-    return vector<string>{istream_iterator<string>{iss}, istream_iterator<string>{}}; // Uses istream_iterator to iterate over words in the stream and collects them into a vector.
+
+/**
+ * A shell variable. Only exported variables are passed to launched commands.
+ */
+struct ShellVariable {
+    string name;           // Empty for a slot that has never been used.
+    string value;
+    bool exported = false;
+    bool deleted = false;  // Left behind by unset, so lookups keep probing past the slot.
+};
+
+/**
+ * The shell's variables in an open-addressing hash table with linear probing. The capacity is
+ * a power of two and the table grows before live and deleted slots fill three quarters of it.
+ */
+struct VariableTable {
+    vector<ShellVariable> slots = vector<ShellVariable>(64);
+    size_t occupied = 0; // Slots that are in use or deleted.
+
+    static size_t hashName(string_view name) {
+        size_t hash = 14695981039346656037ull; // FNV-1a
+        for (char c : name) hash = (hash ^ (unsigned char) c) * 1099511628211ull;
+        return hash;
+    }
+
+    /**
+     * Finds the slot holding a name, or the slot where it would be inserted.
+     */
+    size_t probe(string_view name) const {
+        size_t mask = slots.size() - 1;
+        size_t reusable = slots.size(); // The first deleted slot passed on the way.
+        for (size_t i = hashName(name) & mask;; i = (i + 1) & mask) {
+            const ShellVariable& slot = slots[i];
+            if (slot.name.empty()) return reusable != slots.size() ? reusable : i;
+            if (slot.deleted) {
+                if (reusable == slots.size()) reusable = i;
+            } else if (slot.name == name) {
+                return i;
+            }
+        }
+    }
+
+    ShellVariable* find(string_view name) {
+        ShellVariable& slot = slots[probe(name)];
+        return slot.name.empty() || slot.deleted ? nullptr : &slot;
+    }
+
+    /**
+     * Returns the variable with the given name, adding it unset and unexported if needed.
+     */
+    ShellVariable& insert(string_view name) {
+        size_t i = probe(name);
+        if (!slots[i].name.empty() && !slots[i].deleted) return slots[i];
+        if (slots[i].name.empty()) {
+            if ((occupied + 1) * 4 > slots.size() * 3) {
+                grow();
+                i = probe(name);
+            }
+            occupied++;
+        }
+        ShellVariable& slot = slots[i];
+        slot.name = name;
+        slot.value.clear();
+        slot.exported = slot.deleted = false;
+        return slot;
+    }
+
+    void erase(ShellVariable& variable) {
+        variable.deleted = true;
+        variable.value.clear();
+    }
+
+    /**
+     * Doubles the capacity, rehashing the live variables and dropping deleted slots.
+     */
+    void grow() {
+        vector<ShellVariable> old = move(slots);
+        slots = vector<ShellVariable>(old.size() * 2);
+        occupied = 0;
+        for (ShellVariable& variable : old) {
+            if (variable.name.empty() || variable.deleted) continue;
+            slots[probe(variable.name)] = move(variable);
+            occupied++;
+        }
+    }
+};
+
+VariableTable shellVariables;    // Every variable the shell knows, exported or not.
+bool environmentChanged = true;  // An exported variable changed since the envp below was built.
+vector<char> environmentBlock;   // "name=value" strings for the exported variables, each null-terminated.
+vector<char*> environmentVector; // Pointers into environmentBlock, ending with a null, passed to children as envp.
+
+/**
+ * Tells whether a word is a valid variable name: a letter or underscore followed by letters, digits and underscores.
+ */
+bool isValidName(string_view name) {
+    if (name.empty() || isdigit((unsigned char) name[0])) return false;
+    return all_of(name.begin(), name.end(), [](char c) { return isalnum((unsigned char) c) || c == '_'; });
+}
+
+/**
+ * Returns a variable's value, or nullptr if it is not set. The shell's replacement for getenv().
+ */
+const char* variableValue(string_view name) {
+    ShellVariable* variable = shellVariables.find(name);
+    return variable ? variable->value.c_str() : nullptr;
+}
+
+/**
+ * Sets a variable. A new variable is not exported; an exported one stays exported.
+ */
+void setVariable(string_view name, string_view value) {
+    ShellVariable& variable = shellVariables.insert(name);
+    if (variable.exported && variable.value != value) environmentChanged = true;
+    variable.value = value;
+}
+
+/**
+ * Marks a variable for the environment of launched commands, creating it empty if it is not set.
+ */
+void exportVariable(string_view name) {
+    ShellVariable& variable = shellVariables.insert(name);
+    if (!variable.exported) environmentChanged = true;
+    variable.exported = true;
+}
+
+void unsetVariable(string_view name) {
+    ShellVariable* variable = shellVariables.find(name);
+    if (!variable) return;
+    if (variable->exported) environmentChanged = true;
+    shellVariables.erase(*variable);
+}
+
+/**
+ * Loads the environment the shell was started with as exported variables.
+ */
+void importEnvironment() {
+    for (char** entry = environ; *entry; ++entry) {
+        const char* equal = strchr(*entry, '=');
+        if (!equal) continue;
+        string_view name(*entry, equal - *entry);
+        setVariable(name, equal + 1);
+        exportVariable(name);
+    }
+}
+
+/**
+ * Returns the envp for launched commands. It is rebuilt only after an exported variable has
+ * changed, so assigning ordinary variables, however often, costs no environment copies.
+ * Only the main thread calls this; launcher threads are handed the pointer.
+ */
+char* const* exportedEnvironment() {
+    if (!environmentChanged) return environmentVector.data();
+    environmentBlock.clear();
+    vector<size_t> offsets;
+    for (const ShellVariable& variable : shellVariables.slots) {
+        if (variable.name.empty() || variable.deleted || !variable.exported) continue;
+        offsets.push_back(environmentBlock.size());
+        environmentBlock.insert(environmentBlock.end(), variable.name.begin(), variable.name.end());
+        environmentBlock.push_back('=');
+        environmentBlock.insert(environmentBlock.end(), variable.value.begin(), variable.value.end());
+        environmentBlock.push_back('\0');
+    }
+    environmentVector.clear();
+    for (size_t offset : offsets) environmentVector.push_back(environmentBlock.data() + offset);
+    environmentVector.push_back(nullptr);
+    environmentChanged = false;
+    return environmentVector.data();
+}
+
+/**
+ * Returns the envp for a command run with "name=value ..." in front of it: the exported
+ * environment with those variables replaced or added. Only the pointer array is copied, into
+ * commandArena, so entries that are not overridden stay shared and the shell's own variables
+ * are left alone.
+ * @param assignments The command's prefix assignments.
+ */
+char* const* environmentWith(const vector<string>& assignments) {
+    char* const* base = exportedEnvironment();
+    if (assignments.empty()) return base;
+    size_t count = environmentVector.size() - 1;
+    char** envp = static_cast<char**>(commandArena.allocate((count + assignments.size() + 1) * sizeof(char*), alignof(char*)));
+    memcpy(envp, base, count * sizeof(char*));
+    for (const string& assignment : assignments) {
+        size_t prefix = assignment.find('=') + 1; // The name and its "=".
+        char** entry = find_if(envp, envp + count, [&](const char* e) { return strncmp(e, assignment.c_str(), prefix) == 0; });
+        if (entry == envp + count) count++;
+        *entry = commandArena.copyString(assignment);
+    }
+    envp[count] = nullptr;
+    return envp;
+}
+
+/**
+ * The mechanisms available for launching a child process. posix_spawn and vfork start the
+ * child without copying the shell's page tables, fork is kept as the portable fallback.
+ */
+enum class SpawnBackend { PosixSpawn, Vfork, Fork };
+
+SpawnBackend spawnBackend = SpawnBackend::PosixSpawn; // Selected with "set -o spawn=<name>" or MISH_SPAWN.
+
+/**
+ * A single file descriptor operation applied in the child between fork and exec.
+ * Redirections and pipe plumbing are both described as a list of these.
+ */
+struct FdAction {
+    enum Kind { Open, Dup, Close };
+    Kind kind;
+    int fd;        // Descriptor in the child the action applies to.
+    int source;    // Descriptor duplicated onto fd for Dup.
+    const char* path; // File opened onto fd for Open, kept in commandArena.
+    int flags;     // open() flags for Open.
+};
+
+using FdActions = ArenaVector<FdAction>;
+
+FdAction openAction(int fd, const string& path, int flags) {
+    return {FdAction::Open, fd, -1, commandArena.copyString(path), flags};
+}
+FdAction dupAction(int source, int fd) { return {FdAction::Dup, fd, source, nullptr, 0}; }
+FdAction closeAction(int fd) { return {FdAction::Close, fd, -1, nullptr, 0}; }
+
+const int firstShellFd = 10; // Descriptors below this belong to the user, for "3>file" and "exec 3>>log".
+
+/**
+ * Moves a descriptor the shell keeps open to firstShellFd or above, close-on-exec, so that a
+ * redirection naming a low descriptor never lands on it.
+ * @return The new descriptor, or fd itself if it is -1, already high enough, or can't be moved.
+ */
+int moveShellFd(int fd) {
+    if (fd == -1 || fd >= firstShellFd) return fd;
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, firstShellFd);
+    if (moved == -1) return fd;
+    close(fd);
+    return moved;
+}
+
+/**
+ * Maps a backend name used by "set -o spawn" to its enum value.
+ * @param name One of "posix_spawn", "vfork" or "fork".
+ * @param backend Receives the parsed backend.
+ * @return true if the name was recognized.
+ */
+bool parseSpawnBackend(const string& name, SpawnBackend& backend) {
+    if (name == "posix_spawn") backend = SpawnBackend::PosixSpawn;
+    else if (name == "vfork") backend = SpawnBackend::Vfork;
+    else if (name == "fork") backend = SpawnBackend::Fork;
+    else return false;
+    return true;
+}
+
+const char* spawnBackendName(SpawnBackend backend) {
+    switch (backend) {
+        case SpawnBackend::PosixSpawn: return "posix_spawn";
+        case SpawnBackend::Vfork: return "vfork";
+        default: return "fork";
+    }
+}
+
+/**
+ * Applies the file actions inside a freshly forked or vforked child. Only async-signal-safe
+ * calls are made here, since a vforked child shares the parent's memory.
+ * @return 0 on success, otherwise the errno of the failing action.
+ */
+int applyFdActions(const FdActions& actions) {
+    for (const FdAction& action : actions) {
+        if (action.kind == FdAction::Open) {
+            int fd = open(action.path, action.flags, 0644);
+            if (fd == -1) return errno;
+            if (fd != action.fd) {
+                if (dup2(fd, action.fd) == -1) return errno;
+                close(fd);
+            }
+        } else if (action.kind == FdAction::Dup) {
+            if (action.source == action.fd) {
+                fcntl(action.fd, F_SETFD, 0); // dup2 onto itself would keep FD_CLOEXEC set.
+            } else if (dup2(action.source, action.fd) == -1) {
+                return errno;
+            }
+        } else {
+            close(action.fd);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Process group and terminal settings for a launched child.
+ */
+struct SpawnOptions {
+    pid_t pgid = 0;          // Process group to join, 0 to lead a new one.
+    bool foreground = false; // Give the group the terminal when the shell owns it.
+    char* const* environment = nullptr; // envp for the child; the shell's exported variables when null.
+    const char* path = nullptr;         // PATH given as a prefix assignment, searched instead of the shell's.
+};
+
+pid_t shellPgid = 0;      // The shell's own process group.
+int terminalFd = -1;      // The controlling terminal when the shell is in its foreground, otherwise -1.
+bool jobControl = true;   // Whether jobs get process groups of their own; off in subshells, whose commands stay in theirs.
+struct termios shellTmodes; // Terminal modes restored whenever a foreground job gives the terminal back.
+
+const int jobControlSignals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD, SIGPIPE};
+
+/**
+ * Moves a forked or vforked child into its process group, hands it the terminal if it runs in
+ * the foreground, and restores the signal dispositions and mask the shell changed for itself.
+ */
+void prepareChild(const SpawnOptions& options) {
+    if (jobControl) setpgid(0, options.pgid);
+    if (options.foreground && terminalFd != -1) {
+        tcsetpgrp(terminalFd, options.pgid ? options.pgid : getpid()); // SIGTTOU is still ignored here.
+    }
+    for (int sig : jobControlSignals) signal(sig, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, nullptr);
+}
+
+/**
+ * Repeats a new child's process group and terminal changes from the shell's side, so neither
+ * depends on the child having run yet.
+ */
+void placeInProcessGroup(pid_t pid, const SpawnOptions& options) {
+    pid_t pgid = options.pgid ? options.pgid : pid;
+    if (jobControl) setpgid(pid, pgid);
+    if (options.foreground && terminalFd != -1) {
+        tcsetpgrp(terminalFd, pgid);
+    }
+}
+
+/**
+ * Launches an executable with the given file actions using the selected spawn backend.
+ * Failures to open a redirection or to exec are reported back to the parent, so every
+ * backend returns the same way: a pid on success, or -1 with error set and no child left over.
+ * @param path The resolved path of the executable.
+ * @param argv The null-terminated argument vector.
+ * @param actions File descriptor operations to perform before exec.
+ * @param options The process group and terminal settings for the child.
+ * @param error Receives the errno describing a failed launch.
+ * @return The child's pid, or -1 on failure.
+ */
+pid_t spawnProcess(const char* path, char* const argv[], const FdActions& actions,
+                   const SpawnOptions& options, int& error) {
+    error = 0;
+    pid_t pid = -1;
+    char* const* envp = options.environment ? options.environment : exportedEnvironment();
+
+    if (spawnBackend == SpawnBackend::PosixSpawn) {
+        posix_spawn_file_actions_t fileActions;
+        posix_spawn_file_actions_init(&fileActions);
+        for (const FdAction& action : actions) {
+            if (action.kind == FdAction::Open) {
+                posix_spawn_file_actions_addopen(&fileActions, action.fd, action.path, action.flags, 0644);
+            } else if (action.kind == FdAction::Dup) {
+                posix_spawn_file_actions_adddup2(&fileActions, action.source, action.fd);
+            } else {
+                posix_spawn_file_actions_addclose(&fileActions, action.fd);
+            }
+        }
+
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | (jobControl ? POSIX_SPAWN_SETPGROUP : 0);
+        posix_spawnattr_setpgroup(&attributes, options.pgid);
+        sigset_t none, defaults;
+        sigemptyset(&none);
+        sigemptyset(&defaults);
+        for (int sig : jobControlSignals) sigaddset(&defaults, sig);
+        posix_spawnattr_setsigmask(&attributes, &none);
+        posix_spawnattr_setsigdefault(&attributes, &defaults);
+#ifdef POSIX_SPAWN_TCSETPGROUP
+        if (options.foreground && terminalFd != -1) {
+            flags |= POSIX_SPAWN_TCSETPGROUP;
+            posix_spawnattr_tcsetpgrp_np(&attributes, terminalFd);
+        }
+#endif
+        posix_spawnattr_setflags(&attributes, flags);
+
+        error = posix_spawn(&pid, path, &fileActions, &attributes, argv, envp);
+        posix_spawnattr_destroy(&attributes);
+        posix_spawn_file_actions_destroy(&fileActions);
+        if (error != 0) return -1;
+    } else if (spawnBackend == SpawnBackend::Vfork) {
+        volatile int childError = 0; // Written by the child, which shares our memory until it execs.
+        pid = vfork();
+        if (pid == 0) {
+            prepareChild(options);
+            int err = applyFdActions(actions);
+            if (err == 0) {
+                execve(path, argv, envp);
+                err = errno;
+            }
+            childError = err;
+            _exit(127);
+        }
+        if (pid == -1) {
+            error = errno;
+            return -1;
+        }
+        if (childError != 0) {
+            waitpid(pid, nullptr, 0);
+            error = childError;
+            return -1;
+        }
+    } else {
+        // Plain fork: the child reports a failed exec through a close-on-exec pipe.
+        int errorPipe[2];
+        if (pipe2(errorPipe, O_CLOEXEC) == -1) {
+            error = errno;
+            return -1;
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(errorPipe[0]);
+            prepareChild(options);
+            int err = applyFdActions(actions);
+            if (err == 0) {
+                execve(path, argv, envp);
+                err = errno;
+            }
+            write(errorPipe[1], &err, sizeof(err));
+            _exit(127);
+        }
+        close(errorPipe[1]);
+        if (pid == -1) {
+            error = errno;
+            close(errorPipe[0]);
+            return -1;
+        }
+        int childError = 0;
+        ssize_t n;
+        while ((n = read(errorPipe[0], &childError, sizeof(childError))) == -1 && errno == EINTR) {}
+        close(errorPipe[0]);
+        if (n == sizeof(childError)) {
+            waitpid(pid, nullptr, 0);
+            error = childError;
+            return -1;
+        }
+    }
+
+    placeInProcessGroup(pid, options);
+    return pid;
+}
+
+/**
+ * A remembered PATH lookup. An empty path records that the command was not found.
+ */
+struct HashEntry {
+    string path;
+    unsigned hits;
+};
+
+unordered_map<string, HashEntry> commandHash; // Command name to resolved executable, as shown by "hash".
+
+/**
+ * Searches PATH for an executable regular file, the way execvp would.
+ * @param name The command name, which must not contain a slash.
+ * @param pathValue The directory list to search, or null for the shell's PATH.
+ * @return The full path, or an empty string if no directory has it.
+ */
+string searchPath(const string& name, const char* pathValue = nullptr) {
+    const char* pathEnv = pathValue ? pathValue : variableValue("PATH");
+    string searchPath = pathEnv ? pathEnv : "/bin:/usr/bin"; // execvp's default when PATH is unset.
+    size_t start = 0;
+    while (start <= searchPath.size()) {
+        size_t end = searchPath.find(':', start);
+        if (end == string::npos) end = searchPath.size();
+        string dir = searchPath.substr(start, end - start);
+        string candidate = dir.empty() ? name : dir + "/" + name; // An empty entry means the current directory.
+        struct stat info;
+        if (stat(candidate.c_str(), &info) == 0 && S_ISREG(info.st_mode) && access(candidate.c_str(), X_OK) == 0) {
+            return candidate;
+        }
+        start = end + 1;
+    }
+    return "";
+}
+
+/**
+ * Finds the value of a PATH prefix assignment, as in "PATH=/opt/bin cmd".
+ * @param assignments The command's prefix assignments.
+ * @return The value, or null when PATH is not among them.
+ */
+const char* assignedPath(const vector<string>& assignments) {
+    for (auto it = assignments.rbegin(); it != assignments.rend(); ++it) { // The last one wins.
+        if (it->compare(0, 5, "PATH=") == 0) return it->c_str() + 5;
+    }
+    return nullptr;
+}
+
+/**
+ * Resolves a command name to an executable path through the hash table, searching PATH
+ * only on a miss. Misses are cached too, until "hash -r" or a PATH change clears them.
+ * A PATH given for this command alone is searched directly and leaves the table alone,
+ * since its results do not hold for the shell's own PATH.
+ * @param name The command name.
+ * @param path Receives the resolved path.
+ * @param pathValue The command's own PATH, from assignedPath, or null.
+ * @return true if the command was found.
+ */
+bool resolveCommand(const string& name, string& path, const char* pathValue = nullptr) {
+    if (name.find('/') != string::npos) { // Paths are used as given, like execvp does.
+        path = name;
+        return true;
+    }
+    if (pathValue) {
+        path = searchPath(name, pathValue);
+        return !path.empty();
+    }
+    auto it = commandHash.find(name);
+    if (it == commandHash.end()) {
+        it = commandHash.emplace(name, HashEntry{searchPath(name), 0}).first;
+    }
+    if (it->second.path.empty()) return false;
+    it->second.hits++;
+    path = it->second.path;
+    return true;
+}
+
+/**
+ * Launches an already resolved executable, handing files without a #! line to /bin/sh the
+ * way execvp does.
+ * @param path The executable.
+ * @param argv The null-terminated argument vector.
+ * @param actions File descriptor operations to perform before exec.
+ * @param options The process group and terminal settings for the child.
+ * @param error Receives the errno describing a failed launch.
+ * @return The child's pid, or -1 on failure.
+ */
+pid_t spawnResolved(const string& path, char* const argv[], const FdActions& actions,
+                    const SpawnOptions& options, int& error) {
+    pid_t pid = spawnProcess(path.c_str(), argv, actions, options, error);
+    if (pid == -1 && error == ENOEXEC) {
+        vector<char*> shellArgs = {const_cast<char*>("sh"), const_cast<char*>(path.c_str())};
+        for (char* const* arg = argv + 1; *arg; ++arg) shellArgs.push_back(*arg);
+        shellArgs.push_back(nullptr);
+        pid = spawnProcess("/bin/sh", shellArgs.data(), actions, options, error);
+    }
+    return pid;
+}
+
+/**
+ * Resolves and launches a command. When a cached executable has disappeared the entry is
+ * dropped and PATH searched again.
+ * @param argv The null-terminated argument vector.
+ * @param actions File descriptor operations to perform before exec.
+ * @param options The process group and terminal settings for the child.
+ * @param error Receives the errno describing a failed launch.
+ * @return The child's pid, or -1 on failure.
+ */
+pid_t launchCommand(char* const argv[], const FdActions& actions, const SpawnOptions& options, int& error) {
+    string path;
+    if (!resolveCommand(argv[0], path, options.path)) {
+        error = ENOENT;
+        return -1;
+    }
+    pid_t pid = spawnResolved(path, argv, actions, options, error);
+    if (pid == -1 && error == ENOENT && !options.path && commandHash.count(argv[0])) {
+        commandHash.erase(argv[0]); // The cached binary is gone; look it up afresh.
+        if (!resolveCommand(argv[0], path)) return -1;
+        pid = spawnResolved(path, argv, actions, options, error);
+    }
+    return pid;
+}
+
+/**
+ * Handles the "hash" builtin. With no arguments it lists the remembered commands,
+ * "-r" forgets them all, "-d name" forgets one, and any other names are looked up and remembered.
+ * @param tokens The command tokens, starting with "hash".
+ */
+int handleHashBuiltin(const vector<string>& tokens) {
+    if (tokens.size() == 1) {
+        bool any = false;
+        for (const auto& entry : commandHash) {
+            if (entry.second.path.empty()) continue;
+            if (!any) cout << "hits\tcommand" << endl;
+            any = true;
+            cout << "   " << entry.second.hits << "\t" << entry.second.path << endl;
+        }
+        if (!any) cout << "hash: hash table empty" << endl;
+        return 0;
+    }
+    if (tokens[1] == "-r") {
+        commandHash.clear();
+        return 0;
+    }
+    int status = 0;
+    if (tokens[1] == "-d") {
+        for (size_t i = 2; i < tokens.size(); ++i) {
+            if (commandHash.erase(tokens[i]) == 0) {
+                cerr << "mish: hash: " << tokens[i] << ": not found" << endl;
+                status = 1;
+            }
+        }
+        return status;
+    }
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        if (tokens[i].find('/') != string::npos) continue;
+        commandHash.erase(tokens[i]);
+        string path;
+        if (!resolveCommand(tokens[i], path)) {
+            cerr << "mish: hash: " << tokens[i] << ": not found" << endl;
+            status = 1;
+        } else {
+            commandHash[tokens[i]].hits = 0;
+        }
+    }
+    return status;
+}
+
+/**
+ * Prints the shell's message for a command that could not be launched.
+ * @param command The command name.
+ * @param error The errno returned by spawnProcess.
+ * @return The exit status the failed command reports: 127 if it was not found, otherwise 126.
+ */
+int reportSpawnError(const char* command, int error) {
+    if (error == ENOENT) {
+        cerr << "mish: '" << command << "': No such file or directory" << endl;
+        return 127;
+    }
+    cerr << "mish: '" << command << "': " << strerror(error) << endl;
+    return 126;
+}
+
+/**
+ * The shell's event loop. Every descriptor the shell waits on, the terminal, the SIGCHLD
+ * signalfd, job pidfds and timerfds, is registered here with a handler, and a single
+ * epoll_wait dispatches whichever of them became ready.
+ */
+int epollFd = -1;
+uint64_t nextWatchId = 1;
+RecyclingMap<uint64_t, function<void()>> watchHandlers; // Registration id to handler.
+RecyclingMap<int, uint64_t> watchIdByFd;                // Watched descriptor to its registration id.
+
+/**
+ * Registers a descriptor with the event loop. Handlers are keyed by a registration id rather
+ * than the descriptor, so an event for a descriptor that was closed and reused in the same
+ * batch is simply dropped.
+ * @param fd The descriptor to watch for readability.
+ * @param handler Called each time the descriptor is readable.
+ * @return false if the descriptor cannot be polled, such as a regular file.
+ */
+bool watchFd(int fd, function<void()> handler) {
+    if (epollFd == -1) epollFd = moveShellFd(epoll_create1(EPOLL_CLOEXEC));
+    uint64_t id = nextWatchId++;
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = id;
+    if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) return false;
+    watchHandlers[id] = move(handler);
+    watchIdByFd[fd] = id;
+    return true;
+}
+
+void unwatchFd(int fd) {
+    auto it = watchIdByFd.find(fd);
+    if (it == watchIdByFd.end()) return;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    watchHandlers.erase(it->second);
+    watchIdByFd.erase(it);
+}
+
+/**
+ * Arms a timerfd and watches it.
+ * @param seconds Delay before the handler runs.
+ * @param repeat Whether the timer keeps firing at the same interval.
+ * @param handler Called on expiry; a one-shot timer is already cancelled when it runs.
+ * @return The timer descriptor, used to cancel it, or -1 on failure.
+ */
+int addTimer(double seconds, bool repeat, function<void()> handler) {
+    int fd = moveShellFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+    if (fd == -1) return -1;
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = (time_t) seconds;
+    spec.it_value.tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9);
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1; // Zero would disarm it.
+    if (repeat) spec.it_interval = spec.it_value;
+    timerfd_settime(fd, 0, &spec, nullptr);
+    watchFd(fd, [fd, repeat, handler]() {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+        if (!repeat) {
+            unwatchFd(fd);
+            close(fd);
+        }
+        handler();
+    });
+    return fd;
+}
+
+void cancelTimer(int fd) {
+    if (fd == -1) return;
+    unwatchFd(fd);
+    close(fd);
+}
+
+/**
+ * Waits for the next batch of ready descriptors and runs their handlers.
+ * @param timeoutMs How long to wait, or -1 to wait indefinitely.
+ */
+void runEventLoopOnce(int timeoutMs = -1) {
+    if (epollFd == -1) epollFd = moveShellFd(epoll_create1(EPOLL_CLOEXEC));
+    struct epoll_event events[32];
+    int count = epoll_wait(epollFd, events, 32, timeoutMs);
+    for (int i = 0; i < count; ++i) {
+        auto it = watchHandlers.find(events[i].data.u64);
+        if (it == watchHandlers.end()) continue; // Unwatched by an earlier handler in this batch.
+        function<void()> handler = it->second;   // Copied, since the handler may unwatch itself.
+        handler();
+    }
+}
+
+/**
+ * The states a job moves through, as reported by "jobs".
+ */
+enum class JobState { Running, Stopped, Done };
+
+/**
+ * I/O counters from /proc/<pid>/io. rchar and wchar count every byte passed through read and
+ * write calls, pipes included; readBytes and writeBytes only what reached storage.
+ */
+struct ProcessIo {
+    uint64_t rchar = 0;
+    uint64_t wchar = 0;
+    uint64_t readBytes = 0;
+    uint64_t writeBytes = 0;
+};
+
+/**
+ * Reads I/O counters in the /proc/<pid>/io format.
+ * @param path The file to read, such as /proc/<pid>/io or /proc/thread-self/io.
+ * @return The counters, left at zero if they cannot be read.
+ */
+ProcessIo readProcessIo(const string& path) {
+    ProcessIo io;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return io;
+    char buffer[512];
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) return io;
+    buffer[n] = '\0';
+    auto field = [&](const char* name) -> uint64_t {
+        const char* found = strstr(buffer, name);
+        return found ? strtoull(found + strlen(name), nullptr, 10) : 0;
+    };
+    io.rchar = field("rchar:");
+    io.wchar = field("wchar:");
+    io.readBytes = field("\nread_bytes:");
+    io.writeBytes = field("\nwrite_bytes:");
+    return io;
+}
+
+/**
+ * Reads the CPU time a process has used so far from /proc/<pid>/stat.
+ * @return User plus system seconds, or 0 if the process is gone.
+ */
+double readProcessCpu(pid_t pid) {
+    int fd = open(("/proc/" + to_string(pid) + "/stat").c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    char buffer[1024];
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0) return 0;
+    buffer[n] = '\0';
+    const char* fields = strrchr(buffer, ')'); // The command name before it may hold spaces.
+    if (!fields) return 0;
+    unsigned long long utime = 0, stime = 0;
+    if (sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) return 0;
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * A pipeline stage the shell runs itself on a helper thread instead of as a child process.
+ * When the work is done the thread stores its exit status and signals doneFd, an eventfd the
+ * event loop watches, so the stage finishes like any other.
+ */
+struct InProcessStage {
+    thread worker;
+    int doneFd = -1;
+    atomic<int> status{0};
+    atomic<bool> finished{false};  // Set once the body has returned, just before doneFd is signalled.
+    atomic<int> cancelled{0};      // The signal the shell stopped it with, as it would a process; 0 while it may run.
+    struct rusage usage = {}; // The thread's own resource usage, filled in before doneFd is signalled.
+    ProcessIo io;             // The thread's I/O counters, likewise.
+
+    ~InProcessStage() {
+        if (doneFd != -1) close(doneFd); // Still open only if the thread was detached.
+    }
+};
+
+const int stageWakeSignal = SIGURG; // Interrupts a helper thread's blocking call; ignored by default elsewhere.
+atomic<int> shellInterrupt{0};       // SIGINT once Ctrl-C interrupts work the shell does itself in the foreground.
+// The signal that stopped the work on this thread: a stage's cancelled flag on its helper thread, Ctrl-C on the main one
+thread_local const atomic<int>* stageCancelled = &shellInterrupt;
+// Bytes this thread has moved with splice, which unlike read, write and sendfile leaves rchar and wchar alone
+thread_local uint64_t splicedBytes = 0;
+
+/**
+ * Checks whether the in-process work running on this thread has been told to stop.
+ * Long copies check it between chunks and after a call interrupted by a signal.
+ * @return The signal it was stopped with, or 0.
+ */
+int inProcessStageCancelled() {
+    return stageCancelled ? stageCancelled->load(memory_order_relaxed) : 0;
+}
+
+/**
+ * Keeps SIGINT away from a helper thread, so Ctrl-C always interrupts the main thread's
+ * blocking call, which is what notices it.
+ */
+void blockInterrupts() {
+    sigset_t interrupt;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, nullptr);
+}
+
+/**
+ * Starts an in-process stage.
+ * @param body The work to run on the helper thread; it returns the stage's exit status.
+ */
+shared_ptr<InProcessStage> startInProcessStage(function<int()> body) {
+    auto stage = make_shared<InProcessStage>();
+    stage->doneFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    // The thread holds its own reference, so a detached thread never outlives its stage
+    stage->worker = thread([stage, body]() {
+        blockInterrupts();
+        stageCancelled = &stage->cancelled;
+        stage->status = body();
+        getrusage(RUSAGE_THREAD, &stage->usage);
+        stage->io = readProcessIo("/proc/thread-self/io");
+        stage->io.rchar += splicedBytes;
+        stage->io.wchar += splicedBytes;
+        stage->finished = true;
+        uint64_t one = 1;
+        write(stage->doneFd, &one, sizeof(one));
+    });
+    return stage;
+}
+
+/**
+ * Tells an in-process stage to stop and wakes its thread if it is blocked on a pipe.
+ * @param sig The signal it is stopped with, which it reports as a process killed by it would.
+ */
+void cancelInProcessStage(InProcessStage& stage, int sig) {
+    if (stage.finished || !stage.worker.joinable()) return;
+    stage.cancelled = sig;
+    pthread_kill(stage.worker.native_handle(), stageWakeSignal);
+}
+
+/**
+ * One process of a job, with its wait status once it has changed state.
+ */
+struct JobProcess {
+    JobProcess(pid_t pid = 0) : pid(pid) {}
+
+    pid_t pid;
+    int status = 0;       // Raw wait status once the process has exited.
+    bool exited = false;
+    bool stopped = false;
+    int pidfd = -1;       // Becomes readable when the process exits.
+    string name;          // Command name, used in statistics.
+    shared_ptr<InProcessStage> inProcess; // Set, with pid 0, for a stage the shell runs itself.
+    ProcessIo io;                              // Read from /proc just before reaping, when the job asks for it.
+    struct rusage usage = {};                  // Resource usage reported by wait4 when reaped.
+    chrono::steady_clock::time_point finished; // When the exit was reaped.
+    double orphanedCpu = -1;                   // CPU seconds used when the stage reading its output exited, or -1.
+    int stopSignal = 0;                        // Signal sent to it then by "set -o pipestop", if any.
+};
+
+/**
+ * A pipe between two pipeline stages, tracked so its capacity can be tuned and reported.
+ */
+struct PipeInfo {
+    ino_t inode = 0;       // Identifies the pipe when reopened through /proc.
+    int initialSize = 0;   // Capacity when the pipeline started.
+    int size = 0;          // Current capacity.
+    int fullSamples = 0;   // Consecutive samples that found the pipe full.
+    int stalls = 0;        // Total samples that found the writer blocked on a full pipe.
+    int grows = 0;         // Times the capacity was doubled.
+    bool connected = true; // Whether the writer's standard output goes into it rather than elsewhere.
+};
+
+/**
+ * A command or pipeline launched by the shell. Every launch becomes a job; foreground jobs
+ * leave the table as soon as they finish, background and stopped ones stay until reported.
+ */
+struct Job {
+    int id = 0;                 // Job number used as %n.
+    pid_t pgid = 0;             // Process group shared by every stage.
+    vector<JobProcess, RecyclingAllocator<JobProcess>> processes;
+    string command;             // Command line shown by "jobs".
+    time_t started = 0;
+    JobState state = JobState::Running;
+    bool background = false;
+    bool hasTmodes = false;     // Whether tmodes holds the terminal modes saved when it stopped.
+    struct termios tmodes;
+    chrono::steady_clock::time_point launched;
+    vector<PipeInfo> pipes;     // pipes[i] connects stage i to stage i + 1.
+    bool collectStats = false;  // Read each stage's I/O counters before reaping it.
+    bool timed = false;         // Report each stage's resource usage when the job finishes ("time").
+    bool timeJson = false;      // Report it as one JSON line instead of a table.
+    int samplerTimer = -1;      // Timer that watches the pipes for adaptive sizing.
+};
+
+RecyclingMap<int, Job> jobTable;                     // Live jobs by job number.
+RecyclingMap<pid_t, pair<int, size_t>> jobByPid;     // Child pid to its job number and process index.
+int highestJobId = 0;
+
+/**
+ * A background job that finished in a script before anything waited for it. Its status is
+ * kept so that a later "wait %n" or "wait pid" still returns it, as in bash.
+ */
+struct FinishedJob {
+    int id;
+    pid_t pid;  // The last launched process, or 0 for a pipeline run entirely in the shell.
+    int status;
+};
+
+deque<FinishedJob> finishedJobs;        // Oldest first; forgotten once waited for or its number is reused.
+const size_t finishedJobLimit = 1024;   // Beyond this the oldest statuses are forgotten.
+int childSignalFd = -1; // signalfd that becomes readable when SIGCHLD is pending.
+bool interactiveShell = false;  // Whether commands come from a terminal; only then are jobs announced and reported.
+bool notifyImmediately = false; // "set -o notify": report finished jobs as they finish, not at the next prompt.
+bool pipefail = false;          // "set -o pipefail": a pipeline fails if any stage fails.
+int lastExitStatus = 0;         // Status of the last foreground command, expanded as $?.
+vector<int> pipeStatus;         // Status of each stage of the last foreground pipeline, expanded as ${PIPESTATUS[n]}.
+bool awaitingInput = false;     // Whether the shell is idle at the prompt.
+bool lineInterrupted = false;   // Set when a foreground job dies of SIGINT; the rest of the line is skipped.
+
+/**
+ * Lets Ctrl-C reach foreground work the interactive shell does itself, such as an in-process
+ * cat, while it lasts. The shell otherwise ignores SIGINT; here a handler installed without
+ * SA_RESTART records it in shellInterrupt and makes the main thread's blocked call return.
+ */
+struct InterruptScope {
+    bool active = interactiveShell;
+
+    InterruptScope() {
+        if (!active) return; // A script's SIGINT keeps its default action.
+        shellInterrupt = 0;
+        struct sigaction interrupt = {};
+        interrupt.sa_handler = [](int sig) { shellInterrupt = sig; };
+        sigemptyset(&interrupt.sa_mask);
+        sigaction(SIGINT, &interrupt, nullptr);
+    }
+
+    ~InterruptScope() {
+        if (!active) return;
+        signal(SIGINT, SIG_IGN);
+        shellInterrupt = 0;
+    }
+
+    bool interrupted() const { return shellInterrupt != 0; }
+};
+
+void recordChildStatus(pid_t pid, int status);
+void markProcessExited(Job& job, JobProcess& process, int status);
+bool reapExitedChild(pid_t pid);
+void notifyWhileIdle();
+
+/**
+ * Watches a pidfd for a job process so its exit is handled as soon as it happens.
+ * Without pidfd support the SIGCHLD signalfd still catches the exit.
+ */
+void watchProcessExit(JobProcess& process) {
+    if (process.exited || process.inProcess) return;
+    process.pidfd = moveShellFd((int) syscall(SYS_pidfd_open, process.pid, 0));
+    if (process.pidfd == -1) return;
+    pid_t pid = process.pid;
+    watchFd(process.pidfd, [pid]() {
+        reapExitedChild(pid);
+        notifyWhileIdle();
+    });
+}
+
+void closePidfd(JobProcess& process) {
+    if (process.pidfd == -1) return;
+    unwatchFd(process.pidfd);
+    close(process.pidfd);
+    process.pidfd = -1;
+}
+
+/**
+ * Joins an in-process stage's thread and releases its eventfd. A thread that is still running
+ * is cancelled and detached instead.
+ * @return The stage's exit status.
+ */
+int finishInProcessStage(JobProcess& process) {
+    InProcessStage* stage = process.inProcess.get();
+    if (!stage) return 0;
+    if (stage->worker.joinable() && !stage->finished) {
+        // Still running as its job is dropped, at exit for instance; it must not hold up the shell
+        cancelInProcessStage(*stage, SIGTERM);
+        stage->worker.detach();
+        if (stage->doneFd != -1) unwatchFd(stage->doneFd); // Closed with the stage, once the thread lets go.
+        return 128 + SIGTERM;
+    }
+    if (stage->worker.joinable()) stage->worker.join();
+    process.usage = stage->usage;
+    process.io = stage->io;
+    if (stage->doneFd != -1) {
+        unwatchFd(stage->doneFd);
+        close(stage->doneFd);
+        stage->doneFd = -1;
+    }
+    return stage->status;
+}
+
+/**
+ * Watches the eventfd of an in-process stage so it is marked finished when its thread is done.
+ * @param id The job number.
+ * @param index The stage's index within the job.
+ */
+void watchInProcessStage(int id, size_t index) {
+    int doneFd = jobTable.at(id).processes[index].inProcess->doneFd;
+    watchFd(doneFd, [id, index]() {
+        auto it = jobTable.find(id);
+        if (it == jobTable.end()) return;
+        JobProcess& process = it->second.processes[index];
+        int status = finishInProcessStage(process) << 8;
+        int sig = process.inProcess->cancelled;
+        markProcessExited(it->second, process, sig ? sig : status); // Stopped by a signal, it reports one like a process.
+        notifyWhileIdle();
+    });
+}
+
+int pipeStop = 0; // "set -o pipestop[=signal]": sent to a stage whose output is no longer read, 0 for none.
+const double pipeStopGrace = 1.0; // Seconds a stage ignoring SIGPIPE gets before SIGTERM follows.
+
+/**
+ * Checks whether a process still has a pipe open as its standard output.
+ * @param inode The pipe's inode, as recorded in PipeInfo.
+ * @return false if it has closed or replaced that descriptor, or /proc cannot tell.
+ */
+bool writesToPipe(pid_t pid, ino_t inode) {
+    struct stat info;
+    if (inode == 0 || stat(("/proc/" + to_string(pid) + "/fd/1").c_str(), &info) == -1) return false;
+    return S_ISFIFO(info.st_mode) && info.st_ino == inode;
+}
+
+/**
+ * Handles a pipeline stage whose reader has exited, leaving it writing into a pipe nobody reads.
+ * Left alone it runs until its next write fails, which may be never if it ignores SIGPIPE, so
+ * with pipestop on it is sent that signal, and SIGTERM if SIGPIPE has not stopped it after a
+ * grace period. A writer that has already closed its output is only finishing up and is left
+ * alone. Its CPU time so far is noted to report what it used afterwards.
+ * @param reader The index of the stage that exited; the stage before it is the writer.
+ */
+void stopOrphanedWriter(Job& job, size_t reader) {
+    if (reader == 0 || reader > job.pipes.size()) return;
+    if (!job.pipes[reader - 1].connected) return;
+    JobProcess& writer = job.processes[reader - 1];
+    if (writer.exited || writer.inProcess || writer.pid <= 0 || writer.orphanedCpu >= 0) return;
+    if (!writesToPipe(writer.pid, job.pipes[reader - 1].inode)) return;
+    writer.orphanedCpu = readProcessCpu(writer.pid);
+    if (!pipeStop) return;
+    writer.stopSignal = pipeStop;
+    kill(writer.pid, pipeStop);
+    if (writer.stopped) kill(writer.pid, SIGCONT); // So a stopped writer acts on it too.
+    if (pipeStop != SIGPIPE) return;
+    int id = job.id;
+    pid_t pid = writer.pid;
+    addTimer(pipeStopGrace, false, [id, reader, pid]() {
+        auto it = jobTable.find(id);
+        if (it == jobTable.end() || reader > it->second.processes.size()) return;
+        JobProcess& process = it->second.processes[reader - 1];
+        if (process.pid != pid || process.exited) return; // Gone, and the job number perhaps reused.
+        process.stopSignal = SIGTERM;
+        kill(pid, SIGTERM);
+    });
+}
+
+/**
+ * Places a job in the table under the next job number and indexes its processes.
+ * @return The job number.
+ */
+int addJob(Job job) {
+    int id = ++highestJobId;
+    job.id = id;
+    finishedJobs.erase(remove_if(finishedJobs.begin(), finishedJobs.end(), [id](const FinishedJob& finished) {
+        return finished.id == id; // "%n" means the new job from now on.
+    }), finishedJobs.end());
+    job.started = time(nullptr);
+    for (size_t i = 0; i < job.processes.size(); ++i) {
+        if (!job.processes[i].exited && !job.processes[i].inProcess) jobByPid[job.processes[i].pid] = {id, i};
+    }
+    Job& stored = jobTable.emplace(id, move(job)).first->second;
+    for (size_t i = 0; i < stored.processes.size(); ++i) {
+        if (stored.processes[i].inProcess) watchInProcessStage(id, i);
+        else watchProcessExit(stored.processes[i]);
+    }
+    for (size_t i = 1; i < stored.processes.size(); ++i) {
+        if (stored.processes[i].exited) stopOrphanedWriter(stored, i); // A stage that failed to launch.
+    }
+    return id;
+}
+
+void removeJob(int id) {
+    auto it = jobTable.find(id);
+    if (it == jobTable.end()) return;
+    for (JobProcess& process : it->second.processes) {
+        if (!process.exited && !process.inProcess) jobByPid.erase(process.pid);
+        closePidfd(process);
+        finishInProcessStage(process);
+    }
+    cancelTimer(it->second.samplerTimer);
+    jobTable.erase(it);
+    while (highestJobId > 0 && !jobTable.count(highestJobId)) highestJobId--; // Reuse numbers like bash.
+}
+
+/**
+ * Drops every job as the shell exits. In-process stages still running are cancelled and their
+ * threads detached, so no joinable thread is left when the job table is destroyed.
+ */
+void releaseJobs() {
+    vector<int> ids;
+    for (const auto& entry : jobTable) ids.push_back(entry.first);
+    for (int id : ids) removeJob(id);
+}
+
+/**
+ * Records a wait status reported for a child and updates its job's state.
+ * @param pid The child that changed state.
+ * @param status The wait status.
+ */
+void recordChildStatus(pid_t pid, int status) {
+    auto found = jobByPid.find(pid);
+    if (found == jobByPid.end()) return;
+    Job& job = jobTable.at(found->second.first);
+    JobProcess& process = job.processes[found->second.second];
+
+    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+        if (!jobControl) return; // A subshell's commands are stopped and continued along with it.
+        process.stopped = WIFSTOPPED(status);
+        job.state = process.stopped ? JobState::Stopped : JobState::Running;
+        return;
+    }
+    jobByPid.erase(found);
+    markProcessExited(job, process, status);
+}
+
+/**
+ * Records that a job's process or in-process stage has finished, and marks the job done
+ * once all of them have.
+ */
+void markProcessExited(Job& job, JobProcess& process, int status) {
+    process.exited = true;
+    process.stopped = false;
+    process.status = status;
+    process.finished = chrono::steady_clock::now();
+    closePidfd(process);
+    stopOrphanedWriter(job, &process - job.processes.data()); // Cascades upstream as each writer exits.
+    if (all_of(job.processes.begin(), job.processes.end(), [](const JobProcess& p) { return p.exited; })) {
+        job.state = JobState::Done;
+        cancelTimer(job.samplerTimer);
+        job.samplerTimer = -1;
+    }
+}
+
+/**
+ * Reaps a child that has exited, keeping the resource usage wait4 reports. If its job collects
+ * statistics, the I/O counters are read from /proc first, while the process is still a zombie.
+ * @return false if there was nothing to reap.
+ */
+bool reapExitedChild(pid_t pid) {
+    JobProcess* process = nullptr;
+    auto found = jobByPid.find(pid);
+    if (found != jobByPid.end()) {
+        Job& job = jobTable.at(found->second.first);
+        process = &job.processes[found->second.second];
+        if (job.collectStats || job.timed) process->io = readProcessIo("/proc/" + to_string(pid) + "/io");
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, WNOHANG, &usage) != pid) return false;
+    if (process) process->usage = usage;
+    recordChildStatus(pid, status);
+    return true;
+}
+
+/**
+ * Collects every pending child state change without blocking. The signalfd is drained first
+ * so it only becomes readable again for the next SIGCHLD. Each change is peeked with WNOWAIT
+ * so exited children still go through reapExitedChild.
+ */
+void reapChildren() {
+    if (childSignalFd != -1) {
+        struct signalfd_siginfo info;
+        while (read(childSignalFd, &info, sizeof(info)) == sizeof(info)) {}
+    }
+    while (true) {
+        siginfo_t info = {};
+        if (waitid(P_ALL, 0, &info, WEXITED | WSTOPPED | WCONTINUED | WNOHANG | WNOWAIT) == -1 || info.si_pid == 0) {
+            break;
+        }
+        pid_t pid = info.si_pid;
+        if (info.si_code == CLD_EXITED || info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED) {
+            if (!reapExitedChild(pid)) break;
+            continue;
+        }
+        int status;
+        if (waitpid(pid, &status, WNOHANG | WUNTRACED | WCONTINUED) != pid) break;
+        recordChildStatus(pid, status);
+    }
+}
+
+/**
+ * Pipe capacity settings. F_SETPIPE_SZ can raise a pipe's buffer from the default 64 KiB up to
+ * /proc/sys/fs/pipe-max-size, which cuts context switches between stages moving a lot of data.
+ */
+int pipeSize = 0;        // "set -o pipesize=<size>": capacity for new pipes, 0 for the kernel default.
+bool pipeGrow = false;   // "set -o pipegrow": double a pipe's capacity when its writer keeps blocking.
+bool pipeStats = false;  // "set -o pipestats": report pipe capacities and stage throughput.
+const double pipeSampleInterval = 0.05; // Seconds between pipe samples with pipegrow.
+const int pipeGrowAfter = 3;            // Consecutive full samples before a pipe is grown.
+
+/**
+ * Options that apply to one pipeline, set by the "pipesize" and "time" prefixes.
+ */
+struct PipelineOptions {
+    int pipeSize = 0;       // Capacity for this pipeline's pipes, 0 to use the shell option.
+    bool timed = false;     // Report resource usage per stage when it finishes.
+    bool timeJson = false;  // "time -j": report it as a JSON line.
+};
+
+/**
+ * Returns the largest pipe capacity an unprivileged process may set.
+ */
+int maxPipeSize() {
+    static int maxSize = 0;
+    if (maxSize == 0) {
+        ifstream limitFile("/proc/sys/fs/pipe-max-size");
+        if (!(limitFile >> maxSize) || maxSize <= 0) maxSize = 1048576; // The kernel's default limit.
+    }
+    return maxSize;
+}
+
+/**
+ * Parses a size such as 65536, 256K or 1M.
+ * @param text The size, with an optional K, M or G suffix (powers of 1024).
+ * @param size Receives the size in bytes.
+ * @return true if the text was a valid size.
+ */
+bool parseSize(const string& text, int& size) {
+    char* end;
+    double value = strtod(text.c_str(), &end);
+    if (end == text.c_str() || value < 0) return false;
+    switch (toupper(*end)) {
+        case 'K': value *= 1024; ++end; break;
+        case 'M': value *= 1024 * 1024; ++end; break;
+        case 'G': value *= 1024.0 * 1024 * 1024; ++end; break;
+    }
+    if (toupper(*end) == 'B') ++end;
+    if (*end != '\0' || value > INT32_MAX) return false;
+    size = (int) value;
+    return true;
+}
+
+/**
+ * Formats a byte count with a binary unit, e.g. "1.5 MiB".
+ */
+string formatBytes(double bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    int unit = 0;
+    while (bytes >= 1024 && unit < 4) {
+        bytes /= 1024;
+        unit++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+    return text;
+}
+
+/**
+ * Sets a new pipe's capacity, clamped to the system limit.
+ * @return The capacity the pipe ended up with.
+ */
+int applyPipeSize(int fd, int size) {
+    if (size > 0) fcntl(fd, F_SETPIPE_SZ, min(size, maxPipeSize()));
+    return fcntl(fd, F_GETPIPE_SZ);
+}
+
+/**
+ * Checks each pipe of a running pipeline and grows the ones whose writer keeps finding them full.
+ * The shell holds no pipe descriptors itself, since that would change EOF and SIGPIPE for the
+ * stages, so each pipe is reached by briefly opening the writer's /proc/<pid>/fd/1.
+ * @param id The job number of the pipeline.
+ */
+void samplePipes(int id) {
+    auto it = jobTable.find(id);
+    if (it == jobTable.end()) return;
+    Job& job = it->second;
+    for (size_t i = 0; i < job.pipes.size(); ++i) {
+        PipeInfo& pipeInfo = job.pipes[i];
+        const JobProcess& writer = job.processes[i];
+        if (writer.exited || writer.inProcess || pipeInfo.size >= maxPipeSize()) continue;
+
+        string path = "/proc/" + to_string(writer.pid) + "/fd/1";
+        int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) continue;
+        struct stat info;
+        int queued = 0;
+        if (fstat(fd, &info) == 0 && info.st_ino == pipeInfo.inode && ioctl(fd, FIONREAD, &queued) == 0) {
+            if (queued >= pipeInfo.size - 4096) { // Too little room left for another write.
+                pipeInfo.stalls++;
+                if (++pipeInfo.fullSamples >= pipeGrowAfter) {
+                    int grown = fcntl(fd, F_SETPIPE_SZ, min(pipeInfo.size * 2, maxPipeSize()));
+                    if (grown > pipeInfo.size) {
+                        pipeInfo.size = grown;
+                        pipeInfo.grows++;
+                    }
+                    pipeInfo.fullSamples = 0;
+                }
+            } else {
+                pipeInfo.fullSamples = 0;
+            }
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Prints each pipe's capacity and each stage's write throughput for a finished pipeline.
+ */
+void reportPipeStats(const Job& job) {
+    for (size_t i = 0; i < job.pipes.size(); ++i) {
+        const PipeInfo& pipeInfo = job.pipes[i];
+        cerr << "mish: pipe " << i + 1 << ": " << formatBytes(pipeInfo.initialSize);
+        if (pipeInfo.size != pipeInfo.initialSize) cerr << " -> " << formatBytes(pipeInfo.size);
+        cerr << " (" << pipeInfo.grows << " grows, " << pipeInfo.stalls << " full samples)" << endl;
+    }
+    for (size_t i = 0; i < job.processes.size(); ++i) {
+        const JobProcess& process = job.processes[i];
+        if (process.pid == 0) continue;
+        double seconds = chrono::duration<double>(process.finished - job.launched).count();
+        cerr << "mish: stage " << i + 1 << " " << process.name << ": " << formatBytes(process.io.wchar)
+             << " written in " << fixed << setprecision(3) << seconds << " s ("
+             << formatBytes(seconds > 0 ? process.io.wchar / seconds : 0) << "/s)" << defaultfloat << endl;
+    }
+}
+
+/**
+ * Converts a raw wait status to a shell exit status: the exit code, or 128 plus the signal number.
+ */
+int exitStatusOf(int status) {
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/**
+ * Returns the exit status of a finished job: that of its last process, or with pipefail the
+ * last stage that failed.
+ */
+int jobExitStatus(const Job& job) {
+    if (job.processes.empty()) return 0;
+    if (pipefail) {
+        for (auto it = job.processes.rbegin(); it != job.processes.rend(); ++it) {
+            if (exitStatusOf(it->status) != 0) return exitStatusOf(it->status);
+        }
+        return 0;
+    }
+    return exitStatusOf(job.processes.back().status);
+}
+
+/**
+ * Converts a timeval from struct rusage to seconds.
+ */
+double secondsOf(const struct timeval& time) {
+    return time.tv_sec + time.tv_usec / 1e6;
+}
+
+/**
+ * Quotes a string for use in JSON output.
+ */
+string jsonQuote(const string& text) {
+    string quoted = "\"";
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            quoted += escape;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Prints the resource usage of a finished "time" job: wall time, user and system CPU, peak
+ * resident set, voluntary and involuntary context switches and bytes read and written, for
+ * every stage and in total. Stages the shell ran itself report their thread's usage, except
+ * for the peak resident set, which a thread does not have of its own; it is shown as "-".
+ */
+void reportJobTimes(const Job& job) {
+    auto residentText = [](long kilobytes, bool json) -> string {
+        if (kilobytes < 0) return json ? "null" : "-";
+        return json ? to_string(kilobytes) : formatBytes(kilobytes * 1024.0);
+    };
+    auto now = chrono::steady_clock::now();
+    double totalUser = 0, totalSystem = 0, totalReal = 0;
+    long maxResident = -1, voluntary = 0, involuntary = 0; // -1 until a process reports its peak.
+    ProcessIo totalIo;
+    ostringstream stages;
+    char line[256];
+
+    for (size_t i = 0; i < job.processes.size(); ++i) {
+        const JobProcess& process = job.processes[i];
+        bool ran = process.pid != 0 || process.inProcess;
+        auto finished = ran && process.finished.time_since_epoch().count() ? process.finished : job.launched;
+        double real = chrono::duration<double>(finished - job.launched).count();
+        double user = secondsOf(process.usage.ru_utime), system = secondsOf(process.usage.ru_stime);
+        totalReal = max(totalReal, real);
+        totalUser += user;
+        totalSystem += system;
+        long resident = process.inProcess ? -1 : process.usage.ru_maxrss; // Otherwise the whole shell's.
+        maxResident = max(maxResident, resident);
+        voluntary += process.usage.ru_nvcsw;
+        involuntary += process.usage.ru_nivcsw;
+        totalIo.rchar += process.io.rchar;
+        totalIo.wchar += process.io.wchar;
+        totalIo.readBytes += process.io.readBytes;
+        totalIo.writeBytes += process.io.writeBytes;
+
+        if (job.timeJson) {
+            snprintf(line, sizeof(line),
+                     "%s{\"command\":%s,\"pid\":%d,\"in_process\":%s,\"status\":%d,\"real\":%.6f,\"user\":%.6f,"
+                     "\"sys\":%.6f,\"maxrss_kb\":%s,\"nvcsw\":%ld,\"nivcsw\":%ld,",
+                     i ? "," : "", jsonQuote(process.name).c_str(), process.pid, process.inProcess ? "true" : "false",
+                     exitStatusOf(process.status), real, user, system, residentText(resident, true).c_str(),
+                     process.usage.ru_nvcsw, process.usage.ru_nivcsw);
+            stages << line;
+            snprintf(line, sizeof(line), "\"rchar\":%llu,\"wchar\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu}",
+                     (unsigned long long) process.io.rchar, (unsigned long long) process.io.wchar,
+                     (unsigned long long) process.io.readBytes, (unsigned long long) process.io.writeBytes);
+            stages << line;
+        } else {
+            snprintf(line, sizeof(line), "%5zu %-12.12s %9.3fs %9.3fs %9.3fs %10s %6ld %6ld %10s %10s\n",
+                     i + 1, process.name.c_str(), real, user, system, residentText(resident, false).c_str(),
+                     process.usage.ru_nvcsw, process.usage.ru_nivcsw, formatBytes(process.io.rchar).c_str(),
+                     formatBytes(process.io.wchar).c_str());
+            stages << line;
+        }
+    }
+    if (job.processes.empty()) totalReal = chrono::duration<double>(now - job.launched).count();
+
+    if (job.timeJson) {
+        snprintf(line, sizeof(line),
+                 "{\"command\":%s,\"status\":%d,\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%s,"
+                 "\"nvcsw\":%ld,\"nivcsw\":%ld,",
+                 jsonQuote(job.command).c_str(), jobExitStatus(job), totalReal, totalUser, totalSystem,
+                 residentText(maxResident, true).c_str(),
+                 voluntary, involuntary);
+        cerr << line;
+        snprintf(line, sizeof(line), "\"rchar\":%llu,\"wchar\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,",
+                 (unsigned long long) totalIo.rchar, (unsigned long long) totalIo.wchar,
+                 (unsigned long long) totalIo.readBytes, (unsigned long long) totalIo.writeBytes);
+        cerr << line << "\"stages\":[" << stages.str() << "]}" << endl;
+        return;
+    }
+    snprintf(line, sizeof(line), "%5s %-12s %10s %10s %10s %10s %6s %6s %10s %10s\n", "stage", "command", "real",
+             "user", "sys", "maxrss", "vcsw", "ivcsw", "read", "written");
+    cerr << line << stages.str();
+    snprintf(line, sizeof(line), "%5s %-12s %9.3fs %9.3fs %9.3fs %10s %6ld %6ld %10s %10s\n", "", "total", totalReal,
+             totalUser, totalSystem, residentText(maxResident, false).c_str(), voluntary, involuntary,
+             formatBytes(totalIo.rchar).c_str(), formatBytes(totalIo.wchar).c_str());
+    cerr << line;
+}
+
+const double orphanedCpuNotice = 1.0; // CPU seconds after which a stage's wasted time is reported unasked.
+
+/**
+ * Prints the CPU time each stage of a finished pipeline used after the stage reading its output
+ * exited, which was spent on output nobody read. With pipestats or "time" every such stage is
+ * listed, otherwise only those that wasted a noticeable amount.
+ */
+void reportOrphanedStages(const Job& job) {
+    bool always = job.collectStats || (job.timed && !job.timeJson);
+    for (size_t i = 0; i < job.processes.size(); ++i) {
+        const JobProcess& process = job.processes[i];
+        if (process.orphanedCpu < 0) continue;
+        double wasted = max(0.0, secondsOf(process.usage.ru_utime) + secondsOf(process.usage.ru_stime) - process.orphanedCpu);
+        if (!always && wasted < orphanedCpuNotice) continue;
+        cerr << "mish: stage " << i + 1 << " " << process.name << ": " << fixed << setprecision(3) << wasted
+             << " s CPU after its reader exited" << defaultfloat;
+        if (process.stopSignal) cerr << " (sent " << strsignal(process.stopSignal) << ")";
+        else if (wasted >= orphanedCpuNotice) cerr << " (see \"set -o pipestop\")";
+        cerr << endl;
+    }
+}
+
+/**
+ * Describes a job's state the way "jobs" shows it.
+ */
+string jobStateText(const Job& job) {
+    if (job.state == JobState::Running) return "Running";
+    if (job.state == JobState::Stopped) return "Stopped";
+    int status = job.processes.back().status;
+    if (WIFSIGNALED(status)) return strsignal(WTERMSIG(status));
+    if (WEXITSTATUS(status) != 0) return "Exit " + to_string(WEXITSTATUS(status));
+    return "Done";
+}
+
+/**
+ * Prints one line of job status in the format used by "jobs" and completion notices.
+ */
+void printJob(const Job& job, bool showPid) {
+    char marker = job.id == highestJobId ? '+' : ' ';
+    cout << "[" << job.id << "]" << marker << "  ";
+    if (showPid) cout << job.pgid << " ";
+    string state = jobStateText(job);
+    cout << state << string(state.size() < 24 ? 24 - state.size() : 1, ' ') << job.command;
+    if (job.state == JobState::Running) cout << " &";
+    cout << endl;
+}
+
+/**
+ * Reports background jobs that have finished since the last prompt and drops them from the table.
+ * A script drops them without the "Done" lines, so its table does not grow with every "&", but
+ * keeps their statuses in finishedJobs for "wait".
+ */
+void notifyFinishedJobs() {
+    vector<int> finished;
+    for (const auto& entry : jobTable) {
+        if (entry.second.background && entry.second.state == JobState::Done) finished.push_back(entry.first);
+    }
+    sort(finished.begin(), finished.end());
+    for (int id : finished) {
+        const Job& job = jobTable.at(id);
+        if (interactiveShell) {
+            printJob(job, false);
+        } else {
+            pid_t pid = 0;
+            for (const JobProcess& process : job.processes) {
+                if (process.pid > 0) pid = process.pid;
+            }
+            if (finishedJobs.size() == finishedJobLimit) finishedJobs.pop_front();
+            finishedJobs.push_back({id, pid, jobExitStatus(job)});
+        }
+        if (jobTable.at(id).collectStats) reportPipeStats(jobTable.at(id));
+        if (jobTable.at(id).timed) reportJobTimes(jobTable.at(id));
+        reportOrphanedStages(jobTable.at(id));
+        removeJob(id);
+    }
+}
+
+void printPrompt();
+
+/**
+ * With "set -o notify", reports background jobs the moment they finish while the shell
+ * sits at the prompt, then redraws the prompt.
+ */
+void notifyWhileIdle() {
+    if (!notifyImmediately || !awaitingInput) return;
+    bool finished = any_of(jobTable.begin(), jobTable.end(), [](const pair<const int, Job>& entry) {
+        return entry.second.background && entry.second.state == JobState::Done;
+    });
+    if (!finished) return;
+    cout << endl;
+    notifyFinishedJobs();
+    printPrompt();
+}
+
+/**
+ * Blocks until a job finishes or stops. A foreground job is given the terminal for the duration.
+ * Stages are reaped in whatever order they finish. A stopped job stays in the table as a background
+ * job; a finished one is removed. $? is updated, and for foreground jobs PIPESTATUS as well.
+ * @param id The job number.
+ * @param foreground Whether the job owns the terminal while it runs.
+ * @return The job's exit status, or 128 plus the stop signal if it stopped.
+ */
+int waitForJob(int id, bool foreground) {
+    Job& job = jobTable.at(id);
+    if (foreground && terminalFd != -1 && job.pgid != 0) {
+        tcsetpgrp(terminalFd, job.pgid);
+    }
+
+    InterruptScope interrupt; // Ctrl-C reaches the shell, not a process group, while only its own stages run.
+    bool cancelled = false;
+    while (job.state == JobState::Running) {
+        runEventLoopOnce(); // Exits arrive on the pidfds, stops on the SIGCHLD signalfd.
+        if (foreground && interrupt.interrupted() && !cancelled) {
+            for (JobProcess& process : job.processes) {
+                if (process.inProcess) cancelInProcessStage(*process.inProcess, SIGINT);
+            }
+            cancelled = true;
+        }
+    }
+
+    if (foreground && terminalFd != -1) {
+        tcsetpgrp(terminalFd, shellPgid);
+        job.hasTmodes = tcgetattr(terminalFd, &job.tmodes) == 0;
+        tcsetattr(terminalFd, TCSADRAIN, &shellTmodes);
+    }
+
+    if (job.state == JobState::Stopped) {
+        job.background = true;
+        cout << endl;
+        printJob(job, false);
+        lastExitStatus = 128 + SIGTSTP;
+        return lastExitStatus;
+    }
+    if (job.collectStats) reportPipeStats(job);
+    if (job.timed) reportJobTimes(job);
+    reportOrphanedStages(job);
+    int status = jobExitStatus(job);
+    lastExitStatus = status;
+    if (foreground) {
+        pipeStatus.clear();
+        for (const JobProcess& process : job.processes) pipeStatus.push_back(exitStatusOf(process.status));
+    }
+    if (foreground && WIFSIGNALED(job.processes.back().status)) {
+        int sig = WTERMSIG(job.processes.back().status);
+        if (sig == SIGINT) {
+            cout << endl;
+            lineInterrupted = true;
+        }
+        else if (sig != SIGPIPE) cerr << strsignal(sig) << endl;
+    }
+    removeJob(id);
+    return status;
+}
+
+/**
+ * Registers launched processes as a job and either waits for it or announces it as a background job.
+ * @param job The job with its processes and process group filled in.
+ * @param background Whether the shell returns to the prompt immediately.
+ */
+void startJob(Job job, bool background) {
+    if (none_of(job.processes.begin(), job.processes.end(), [](const JobProcess& p) { return !p.exited; })) {
+        // Nothing could be launched, so there is nothing to wait for
+        if (job.timed) reportJobTimes(job);
+        lastExitStatus = job.processes.empty() ? 127 : jobExitStatus(job);
+        pipeStatus.clear();
+        for (const JobProcess& process : job.processes) pipeStatus.push_back(exitStatusOf(process.status));
+        return;
+    }
+    job.background = background;
+    int id = addJob(move(job));
+    if (pipeGrow && !jobTable.at(id).pipes.empty()) {
+        jobTable.at(id).samplerTimer = addTimer(pipeSampleInterval, true, [id]() { samplePipes(id); });
+    }
+    if (background) {
+        lastExitStatus = 0;
+        if (!interactiveShell) return;
+        pid_t pid = jobTable.at(id).pgid;
+        for (const JobProcess& process : jobTable.at(id).processes) {
+            if (process.pid > 0) pid = process.pid; // An in-process last stage has none; show the last real one.
+        }
+        cout << "[" << id << "]";
+        if (pid > 0) cout << " " << pid; // A pipeline run entirely in the shell has no process to show.
+        cout << endl;
+    } else {
+        waitForJob(id, true);
+    }
+}
+
+/**
+ * Sets up job control: SIGCHLD is delivered through a signalfd, and an interactive shell takes
+ * its own process group and the terminal and ignores the keyboard job control signals.
+ * @param interactive Whether commands are being read from a terminal.
+ */
+void initJobControl(bool interactive) {
+    sigset_t childMask;
+    sigemptyset(&childMask);
+    sigaddset(&childMask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childMask, nullptr);
+    childSignalFd = moveShellFd(signalfd(-1, &childMask, SFD_NONBLOCK | SFD_CLOEXEC));
+    signal(SIGPIPE, SIG_IGN); // In-process stages see EPIPE instead of killing the shell.
+    struct sigaction wake = {};
+    wake.sa_handler = [](int) {};
+    sigemptyset(&wake.sa_mask);
+    sigaction(stageWakeSignal, &wake, nullptr); // Without SA_RESTART, so a cancelled stage's blocked call returns EINTR.
+    watchFd(childSignalFd, []() {
+        reapChildren();
+        notifyWhileIdle();
+    });
+
+    shellPgid = getpgrp();
+    if (!isatty(STDIN_FILENO)) return;
+    if (interactive) {
+        while (tcgetpgrp(STDIN_FILENO) != (shellPgid = getpgrp())) {
+            kill(-shellPgid, SIGTTIN); // Wait until we are brought to the foreground.
+        }
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+    }
+    signal(SIGTTOU, SIG_IGN); // Needed to hand the terminal back and forth.
+    if (interactive && setpgid(0, 0) == 0) {
+        shellPgid = getpid();
+        tcsetpgrp(STDIN_FILENO, shellPgid);
+    }
+    if (tcgetpgrp(STDIN_FILENO) == shellPgid) {
+        terminalFd = STDIN_FILENO;
+        tcgetattr(terminalFd, &shellTmodes);
+    }
+}
+
+/**
+ * Resolves a job specification such as %1, %%, %+, %- or %name, or a plain pid of a job member.
+ * @param spec The specification; an empty string means the current job.
+ * @return The job number, or 0 if no such job exists.
+ */
+int findJob(const string& spec) {
+    if (spec.empty() || spec == "%" || spec == "%%" || spec == "%+") {
+        return jobTable.count(highestJobId) ? highestJobId : 0;
+    }
+    if (spec == "%-") {
+        for (int id = highestJobId - 1; id > 0; --id) {
+            if (jobTable.count(id)) return id;
+        }
+        return 0;
+    }
+    if (spec[0] == '%') {
+        string rest = spec.substr(1);
+        if (!rest.empty() && all_of(rest.begin(), rest.end(), ::isdigit)) {
+            int id = atoi(rest.c_str());
+            return jobTable.count(id) ? id : 0;
+        }
+        for (int id = highestJobId; id > 0; --id) { // %name picks the newest job whose command starts with name.
+            auto it = jobTable.find(id);
+            if (it != jobTable.end() && it->second.command.compare(0, rest.size(), rest) == 0) return id;
+        }
+        return 0;
+    }
+    if (all_of(spec.begin(), spec.end(), ::isdigit)) {
+        auto found = jobByPid.find(atoi(spec.c_str()));
+        return found != jobByPid.end() ? found->second.first : 0;
+    }
+    return 0;
+}
+
+/**
+ * Handles the "jobs" builtin. "-l" also shows each job's process group.
+ */
+int handleJobsBuiltin(const vector<string>& tokens) {
+    bool showPid = tokens.size() > 1 && tokens[1] == "-l";
+    reapChildren();
+    vector<int> ids;
+    for (const auto& entry : jobTable) ids.push_back(entry.first);
+    sort(ids.begin(), ids.end());
+    for (int id : ids) {
+        Job& job = jobTable.at(id);
+        printJob(job, showPid);
+        if (job.state == JobState::Done) removeJob(id);
+    }    return 0;
+}
+
+/**
+ * Handles "fg" and "bg", which continue a stopped or background job in the foreground or background.
+ * @param tokens The command tokens, starting with "fg" or "bg".
+ */
+int handleFgBgBuiltin(const vector<string>& tokens) {
+    bool foreground = tokens[0] == "fg";
+    int id = findJob(tokens.size() > 1 ? tokens[1] : "");
+    if (id == 0) {
+        cerr << "mish: " << tokens[0] << ": " << (tokens.size() > 1 ? tokens[1] : "current") << ": no such job" << endl;
+        return 1;
+    }
+    Job& job = jobTable.at(id);
+    if (foreground) {
+        cout << job.command << endl;
+        if (terminalFd != -1 && job.pgid != 0) {
+            tcsetpgrp(terminalFd, job.pgid);
+            if (job.hasTmodes) tcsetattr(terminalFd, TCSADRAIN, &job.tmodes);
+        }
+    }
+    if (job.pgid != 0) kill(-job.pgid, SIGCONT); // A pipeline run entirely in the shell has no group to continue.
+    job.state = JobState::Running;
+    for (JobProcess& process : job.processes) process.stopped = false;
+    if (foreground) {
+        job.background = false;
+        return waitForJob(id, true);
+    }
+    job.background = true;
+    cout << "[" << id << "] " << job.command << " &" << endl;
+    return 0;
+}
+
+/**
+ * Looks up, and forgets, the status a script kept for a finished job.
+ * @param spec A job number as "%n", or a pid.
+ * @param status Receives the job's exit status.
+ * @return true if the job was found among finishedJobs.
+ */
+bool takeFinishedJob(const string& spec, int& status) {
+    bool byId = spec.size() > 1 && spec[0] == '%';
+    string_view number = byId ? string_view(spec).substr(1) : string_view(spec);
+    if (number.empty() || !all_of(number.begin(), number.end(), ::isdigit)) return false;
+    int value = atoi(number.data());
+    auto it = find_if(finishedJobs.begin(), finishedJobs.end(), [&](const FinishedJob& finished) {
+        return byId ? finished.id == value : value != 0 && finished.pid == value;
+    });
+    if (it == finishedJobs.end()) return false;
+    status = it->status;
+    finishedJobs.erase(it);
+    return true;
+}
+
+/**
+ * Handles the "wait" builtin: waits for the given jobs or pids, or for every background job.
+ * In a script, jobs that have already finished and been dropped are found in finishedJobs.
+ */
+int handleWaitBuiltin(const vector<string>& tokens) {
+    vector<int> ids;
+    int status = 0;
+    if (tokens.size() == 1) {
+        for (const auto& entry : jobTable) ids.push_back(entry.first);
+        sort(ids.begin(), ids.end());
+    }
+    if (tokens.size() == 1) finishedJobs.clear();
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        int id = findJob(tokens[i]);
+        if (id == 0 && takeFinishedJob(tokens[i], status)) continue;
+        if (id == 0) {
+            cerr << "mish: wait: " << tokens[i] << ": no such job" << endl;
+            status = 127;
+            continue;
+        }
+        ids.push_back(id);
+    }
+    for (int id : ids) {
+        if (jobTable.count(id)) status = waitForJob(id, false);
+    }    return tokens.size() == 1 ? 0 : status; // Waiting for everything always succeeds.
+}
+
+/**
+ * Signal names accepted by "kill".
+ */
+const pair<const char*, int> signalNames[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL}, {"USR1", SIGUSR1},
+        {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD},
+        {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+        {"WINCH", SIGWINCH},
+};
+
+/**
+ * Parses a signal given by number or name, with or without the SIG prefix.
+ * @return The signal number, or -1 if it is not recognized.
+ */
+int parseSignal(string name) {
+    if (!name.empty() && all_of(name.begin(), name.end(), ::isdigit)) return atoi(name.c_str());
+    transform(name.begin(), name.end(), name.begin(), ::toupper);
+    if (name.compare(0, 3, "SIG") == 0) name = name.substr(3);
+    for (const auto& entry : signalNames) {
+        if (name == entry.first) return entry.second;
+    }
+    return -1;
+}
+
+/**
+ * Names a signal the way parseSignal accepts it, or by number if it has no name here.
+ */
+string signalName(int sig) {
+    for (const auto& entry : signalNames) {
+        if (entry.second == sig) return entry.first;
+    }
+    return to_string(sig);
+}
+
+/**
+ * Checks whether a signal's default action ends a process, as opposed to stopping, continuing
+ * or ignoring it; such a signal sent to a job also cancels its in-process stages.
+ */
+bool endsProcess(int sig) {
+    switch (sig) {
+        case 0: case SIGCONT: case SIGSTOP: case SIGTSTP: case SIGTTIN: case SIGTTOU:
+        case SIGCHLD: case SIGURG: case SIGWINCH:
+            return false;
+        default:
+            return true;
+    }
+}
+
+/**
+ * Handles the "kill" builtin: kill [-s SIG | -SIG] %job|pid ..., or "kill -l" to list signal names.
+ * Job specifications signal the job's whole process group.
+ */
+int handleKillBuiltin(const vector<string>& tokens) {
+    int sig = SIGTERM;
+    size_t i = 1;
+    if (i < tokens.size() && tokens[i] == "-l") {
+        for (const auto& entry : signalNames) cout << entry.second << ") SIG" << entry.first << endl;
+        return 0;
+    }
+    if (i < tokens.size() && tokens[i] == "-s" && i + 1 < tokens.size()) {
+        sig = parseSignal(tokens[i + 1]);
+        i += 2;
+    } else if (i < tokens.size() && tokens[i].size() > 1 && tokens[i][0] == '-') {
+        sig = parseSignal(tokens[i].substr(1));
+        i++;
+    }
+    if (sig == -1) {
+        cerr << "mish: kill: " << tokens[i - 1] << ": invalid signal specification" << endl;
+        return 1;
+    }
+    if (i == tokens.size()) {
+        cerr << "Usage: kill [-s sigspec | -sigspec] pid | %job ..." << endl;
+        return 2;
+    }
+    int status = 0;
+    for (; i < tokens.size(); ++i) {
+        pid_t target;
+        if (tokens[i][0] == '%') {
+            int id = findJob(tokens[i]);
+            if (id == 0) {
+                cerr << "mish: kill: " << tokens[i] << ": no such job" << endl;
+                status = 1;
+                continue;
+            }
+            Job& job = jobTable.at(id);
+            if (endsProcess(sig)) {
+                for (JobProcess& process : job.processes) {
+                    if (process.inProcess) cancelInProcessStage(*process.inProcess, sig); // Stages without a process to signal.
+                }
+            }
+            if (job.pgid == 0) continue; // Run entirely in the shell.
+            target = -job.pgid;
+        } else {
+            target = atoi(tokens[i].c_str());
+        }
+        if (kill(target, sig) == -1) {
+            cerr << "mish: kill: " << tokens[i] << ": " << strerror(errno) << endl;
+            status = 1;
+        } else if (tokens[i][0] == '%' && (sig == SIGTERM || sig == SIGHUP) &&
+                   jobTable.at(findJob(tokens[i])).state == JobState::Stopped) {
+            kill(target, SIGCONT); // A stopped job would otherwise never act on the signal.
+        }
+    }
+    return status;
+}
+
+/**
+ * A word or operator from a command line. The text points into the line it was lexed from,
+ * and offset is its position there, so errors can point at the offending column. Words keep
+ * their quotes and backslashes until they are expanded.
+ */
+struct Token {
+    string_view text;
+    size_t offset = 0;
+    bool isOperator = false; // One of | || & && ; ( ), a redirection operator such as < >> 2>&1's >& or <<-, or a newline.
+    string_view document;    // For the delimiter after << or <<-: the here-document's lines, up to the delimiter line.
+};
+
+inline bool isOperatorChar(unsigned char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>' || c == '(' || c == ')';
+}
+
+/**
+ * Tells whether a byte ends a word: whitespace or one of the operator characters.
+ */
+inline bool isWordDelimiter(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r') || isOperatorChar(c);
+}
+
+#ifdef MISH_X86_SIMD
+/**
+ * Finds the first byte in whole 16-byte blocks from pos that ends a word or starts quoting:
+ * whitespace, an operator character, a quote, a backquote or a backslash.
+ * @return Its position, or where the unscanned tail begins if no block has one.
+ */
+size_t findDelimiterSse2(const char* data, size_t pos, size_t size) {
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    const __m128i amp = _mm_set1_epi8('&'), three = _mm_set1_epi8(3), quote = _mm_set1_epi8('"');
+    const __m128i semicolon = _mm_set1_epi8(';'), less = _mm_set1_epi8('<'), greater = _mm_set1_epi8('>');
+    const __m128i backslash = _mm_set1_epi8('\\'), pipe = _mm_set1_epi8('|'), backquote = _mm_set1_epi8('`');
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) (data + pos));
+        __m128i fromTab = _mm_sub_epi8(bytes, tab); // \t..\r become 0..4
+        __m128i fromAmp = _mm_sub_epi8(bytes, amp); // & ' ( ) become 0..3
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(bytes, space), _mm_cmpeq_epi8(_mm_min_epu8(fromTab, four), fromTab));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(fromAmp, three), fromAmp), _mm_cmpeq_epi8(bytes, quote)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, semicolon), _mm_cmpeq_epi8(bytes, pipe)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, less), _mm_cmpeq_epi8(bytes, greater)));
+        hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, backslash), _mm_cmpeq_epi8(bytes, backquote)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return pos;
+}
+
+/**
+ * The AVX2 version of findDelimiterSse2, scanning 32 bytes at a time.
+ */
+__attribute__((target("avx2"))) size_t findDelimiterAvx2(const char* data, size_t pos, size_t size) {
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    const __m256i amp = _mm256_set1_epi8('&'), three = _mm256_set1_epi8(3), quote = _mm256_set1_epi8('"');
+    const __m256i semicolon = _mm256_set1_epi8(';'), less = _mm256_set1_epi8('<'), greater = _mm256_set1_epi8('>');
+    const __m256i backslash = _mm256_set1_epi8('\\'), pipe = _mm256_set1_epi8('|'), backquote = _mm256_set1_epi8('`');
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (data + pos));
+        __m256i fromTab = _mm256_sub_epi8(bytes, tab);
+        __m256i fromAmp = _mm256_sub_epi8(bytes, amp);
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, space),
+                                       _mm256_cmpeq_epi8(_mm256_min_epu8(fromTab, four), fromTab));
+        hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(fromAmp, three), fromAmp),
+                                                     _mm256_cmpeq_epi8(bytes, quote)));
+        hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(bytes, semicolon), _mm256_cmpeq_epi8(bytes, pipe)));
+        hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(bytes, less), _mm256_cmpeq_epi8(bytes, greater)));
+        hits = _mm256_or_si256(hits, _mm256_or_si256(_mm256_cmpeq_epi8(bytes, backslash), _mm256_cmpeq_epi8(bytes, backquote)));
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+        if (mask) return pos + __builtin_ctz(mask);
+    }
+    return findDelimiterSse2(data, pos, size);
+}
+#endif
+
+/**
+ * Finds where the unquoted run of a word starting at pos ends. Long runs are scanned a block
+ * at a time with AVX2 where the CPU has it, or SSE2; the last few bytes are checked one by one.
+ * @return The position of the next delimiter, quote, backquote or backslash, or size.
+ */
+size_t findWordEnd(const char* data, size_t pos, size_t size) {
+#ifdef MISH_X86_SIMD
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    pos = hasAvx2 ? findDelimiterAvx2(data, pos, size) : findDelimiterSse2(data, pos, size);
+#endif
+    while (pos < size && !isWordDelimiter(data[pos]) && data[pos] != '\'' && data[pos] != '"' && data[pos] != '`' && data[pos] != '\\') pos++;
+    return pos;
+}
+
+bool skipSubstitution(string_view line, size_t& pos);
+
+/**
+ * Tells whether "<(" or ">(" starts a process substitution at pos, which belongs to a word
+ * rather than being a redirection, even in the middle of one.
+ */
+inline bool startsProcessSubstitution(const char* data, size_t pos, size_t size) {
+    return (data[pos] == '<' || data[pos] == '>') && pos + 1 < size && data[pos + 1] == '(';
+}
+
+/**
+ * Steps over the quoted text, backslash escape, backquoted command or "$(", "<(" or ">("
+ * substitution starting at pos. Inside double quotes a backslash escapes the next character, and
+ * substitutions are skipped whole; inside single quotes nothing is special.
+ * @param line The command line.
+ * @param pos The position of the quote, backslash, "$", "<" or ">"; moved past its end.
+ * @return false if the line ends before it is closed.
+ */
+bool skipQuoted(string_view line, size_t& pos) {
+    char quote = line[pos];
+    if (quote == '\\') {
+        pos += 2;
+        return pos <= line.size();
+    }
+    if (quote == '$' || quote == '<' || quote == '>') return skipSubstitution(line, pos);
+    size_t i = pos + 1;
+    const char* special = quote == '"' ? "\"\\`$" : quote == '`' ? "`\\" : "'";
+    while ((i = line.find_first_of(special, i)) != string_view::npos) {
+        char c = line[i];
+        if (c == quote) {
+            pos = i + 1;
+            return true;
+        }
+        if (c == '\\') {
+            i += 2; // An escaped character.
+        } else if (c == '$') {
+            if (i + 1 < line.size() && line[i + 1] == '(') {
+                if (!skipSubstitution(line, i)) return false;
+            } else {
+                i++;
+            }
+        } else if (!skipQuoted(line, i)) { // A backquoted command inside double quotes.
+            return false;
+        }
+    }
+    return false;
+}
+
+/**
+ * Steps over a "$(...)" command substitution, or a "<(...)" or ">(...)" process substitution,
+ * starting at the "$", "<" or ">" at pos, with any parentheses, quotes and substitutions
+ * nested inside it.
+ * @return false if the line ends before the closing ")".
+ */
+bool skipSubstitution(string_view line, size_t& pos) {
+    int depth = 0;
+    for (size_t i = pos + 1; i < line.size();) {
+        char c = line[i];
+        if (c == '(') {
+            depth++;
+            i++;
+        } else if (c == ')') {
+            if (--depth == 0) {
+                pos = i + 1;
+                return true;
+            }
+            i++;
+        } else if (c == '\'' || c == '"' || c == '`' || c == '\\' || (c == '$' && i + 1 < line.size() && line[i + 1] == '(')) {
+            if (!skipQuoted(line, i)) return false;
+        } else {
+            i++;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reads a here-document's body: the lines from pos up to the one that consists of the
+ * delimiter alone, which is the delimiter word with its quotes removed.
+ * @param pos The start of the body; moved past the delimiter line.
+ * @param delimiter The word after the operator; its document is set to the body.
+ * @param stripTabs Whether leading tabs are ignored, as after <<-.
+ * @return false if the input ends before the delimiter line.
+ */
+bool readHereDocument(string_view line, size_t& pos, Token& delimiter, bool stripTabs) {
+    string word;
+    for (size_t i = 0; i < delimiter.text.size(); ++i) {
+        char c = delimiter.text[i];
+        if (c == '\\' && i + 1 < delimiter.text.size()) word += delimiter.text[++i];
+        else if (c != '\'' && c != '"') word += c;
+    }
+    for (size_t start = pos; start < line.size() || start == pos;) {
+        size_t end = min(line.find('\n', start), line.size());
+        string_view text = line.substr(start, end - start);
+        if (stripTabs) text.remove_prefix(min(text.find_first_not_of('\t'), text.size()));
+        if (text == word) {
+            delimiter.document = line.substr(pos, start - pos);
+            pos = min(end + 1, line.size());
+            return true;
+        }
+        if (end == line.size()) break;
+        start = end + 1;
+    }
+    return false;
+}
+
+/**
+ * Splits a command line into words and operators in one pass without copying it. Operators
+ * are tokens of their own whether or not they are surrounded by spaces, and so is each newline.
+ * Quoted text, escaped characters and command substitutions stay inside their word, and a
+ * "#" starting a word comments out the rest of the line. The lines following a line with
+ * here-document operators are taken as the documents' bodies, each up to its delimiter line.
+ * @param line The command line; it must outlive the tokens.
+ * @param tokens Receives the tokens in order, held in commandArena.
+ * @return false if the line ends inside quotes or a substitution, right after a backslash, or
+ *         before a here-document's delimiter line, so it must continue.
+ */
+bool lexLine(string_view line, ArenaVector<Token>& tokens) {
+    const char* data = line.data();
+    size_t size = line.size(), pos = 0;
+    ArenaVector<pair<size_t, bool>> documents; // Delimiter tokens whose bodies follow the next newline, and whether tabs are stripped.
+    int awaitingDelimiter = 0;                 // 1 after <<, 2 after <<-.
+    while (pos < size) {
+        unsigned char c = data[pos];
+        if (c == '\n') {
+            tokens.push_back({line.substr(pos, 1), pos, true, {}});
+            pos++;
+            for (const auto& document : documents) {
+                if (!readHereDocument(line, pos, tokens[document.first], document.second)) return false;
+            }
+            documents.clear();
+        } else if (isOperatorChar(c) && !startsProcessSubstitution(data, pos, size)) {
+            size_t length = (c == '|' || c == '&') && pos + 1 < size && data[pos + 1] == c ? 2 : 1; // || and &&
+            char next = pos + 1 < size ? data[pos + 1] : '\0';
+            if (c == '<' && next == '<') { // << <<- and <<<
+                length = pos + 2 < size && (data[pos + 2] == '-' || data[pos + 2] == '<') ? 3 : 2;
+                if (length == 2 || data[pos + 2] == '-') awaitingDelimiter = length - 1;
+            } else if ((c == '<' && (next == '&' || next == '>')) || (c == '>' && (next == '>' || next == '&' || next == '|'))) {
+                length = 2; // <& <> >> >& and >|
+            } else if (c == '&' && next == '>') {
+                length = pos + 2 < size && data[pos + 2] == '>' ? 3 : 2; // &> and &>>
+            }
+            tokens.push_back({line.substr(pos, length), pos, true, {}});
+            pos += length;
+            continue;
+        } else if (isWordDelimiter(c) && !isOperatorChar(c)) {
+            pos++;
+            continue;
+        } else if (c == '#') {
+            while (pos < size && data[pos] != '\n') pos++;
+        } else {
+            size_t end = pos, quotedEnd = pos;
+            while ((end = findWordEnd(data, end, size)) < size) {
+                if (data[end] == '(' && end > quotedEnd && data[end - 1] == '$') {
+                    end--; // "$(" starts a command substitution unless the "$" was escaped or quoted.
+                } else if (isWordDelimiter(data[end]) && !startsProcessSubstitution(data, end, size)) {
+                    break;
+                }
+                if (!skipQuoted(line, end)) return false;
+                quotedEnd = end;
+            }
+            tokens.push_back({line.substr(pos, end - pos), pos, false, {}});
+            pos = end;
+            if (awaitingDelimiter) documents.push_back({tokens.size() - 1, awaitingDelimiter == 2});
+        }
+        awaitingDelimiter = 0;
+    }
+    return documents.empty();
+}
+
+/**
+ * A redirection as written: the descriptor it replaces, how its file is opened, and the word
+ * naming the file, which is expanded when the command runs. For a here-document the word is
+ * the delimiter and carries the body; for a here-string it is the data itself; for >& and <&
+ * it names the descriptor to copy, or "-" to close it.
+ */
+struct RedirectWord {
+    enum Kind { File, HereDocument, HereString, Duplicate };
+    int fd;
+    int flags;
+    Token target;
+    Kind kind = File;
+    bool stripTabs = false; // A here-document started with "<<-".
+};
+
+/**
+ * A node of the syntax tree built for each command line, allocated in commandArena.
+ */
+struct Node {
+    enum Kind { Command, Pipeline, And, Or, Sequence, Subshell, Group };
+    Kind kind;
+    string_view text;                   // The source it was parsed from, shown by "jobs".
+    ArenaVector<Node*> children;        // Pipeline stages, list items, both sides of && and ||, or the body of ( ) and { }.
+    ArenaVector<Token> words;           // A command's words as written.
+    ArenaVector<RedirectWord> redirects; // The redirections of a command, ( ) or { }, in order.
+    bool background = false;            // A list item followed by "&".
+    bool negated = false;               // A pipeline preceded by "!".
+    PipelineOptions options;            // A pipeline's "time" and "pipesize" prefixes.
+};
+
+/**
+ * Returns the source text from the start of first to the end of last.
+ */
+string_view spanOf(string_view first, string_view last) {
+    return string_view(first.data(), last.data() + last.size() - first.data());
+}
+
+/**
+ * Recursive-descent parser for the shell's grammar:
+ *
+ *   list     := and_or ((';' | '&' | newline) and_or)* [';' | '&']
+ *   and_or   := pipeline (('&&' | '||') pipeline)*
+ *   pipeline := ['!'] ['time' ['-j'] | 'pipesize' size]* command ('|' command)*
+ *   command  := '(' list ')' | '{' list '}' | (word | '<' word | '>' word)+
+ *
+ * Newlines may also follow '|', '&&', '||', '(' and '{'. "{" and "}" are only reserved where
+ * a command starts. Parsing stops at the first error, keeping its position, or notes that
+ * the input ended before the command was complete.
+ */
+struct Parser {
+    const ArenaVector<Token>& tokens;
+    string_view source;
+    size_t pos = 0;
+    string error;            // The first error, ready to print.
+    bool incomplete = false; // The input ended in the middle of a command.
+    int groupDepth = 0;      // Open "{" groups, inside which "}" ends a list.
+
+    bool atEnd() const { return pos >= tokens.size(); }
+
+    bool isOperator(string_view op) const {
+        return !atEnd() && tokens[pos].isOperator && tokens[pos].text == op;
+    }
+
+    bool isRedirection(size_t at) const {
+        if (at >= tokens.size() || !tokens[at].isOperator) return false;
+        string_view text = tokens[at].text;
+        return text[0] == '<' || text[0] == '>' || (text.size() > 1 && text[0] == '&' && text[1] == '>');
+    }
+
+    bool isRedirection() const { return isRedirection(pos); }
+
+    /**
+     * Tells whether the current word is a descriptor number written right before a
+     * redirection operator, as in 2>err or 3<&0.
+     */
+    bool isDescriptorNumber() const {
+        const Token& token = tokens[pos];
+        return !token.isOperator && token.text.size() <= 4 && isRedirection(pos + 1) && tokens[pos + 1].text[0] != '&' &&
+               tokens[pos + 1].text.data() == token.text.data() + token.text.size() &&
+               all_of(token.text.begin(), token.text.end(), ::isdigit);
+    }
+
+    bool isReserved(string_view word) const {
+        return !atEnd() && !tokens[pos].isOperator && tokens[pos].text == word;
+    }
+
+    bool endsList() const {
+        return atEnd() || isOperator(")") || (groupDepth > 0 && isReserved("}"));
+    }
+
+    void skipNewlines() {
+        while (isOperator("\n")) pos++;
+    }
+
+    Node* newNode(Node::Kind kind) {
+        Node* node = new (commandArena.allocate(sizeof(Node), alignof(Node))) Node();
+        node->kind = kind;
+        return node;
+    }
+
+    /**
+     * Records an error at the current token, unless one was already found.
+     */
+    Node* fail(const string& message) {
+        if (!error.empty()) return nullptr;
+        size_t offset = atEnd() ? source.size() : tokens[pos].offset;
+        size_t lineStart = source.rfind('\n', offset == 0 ? 0 : offset - 1);
+        lineStart = lineStart == string_view::npos || offset == 0 ? 0 : lineStart + 1;
+        error = "mish: " + message + " (";
+        if (source.find('\n') != string_view::npos) {
+            error += "line " + to_string(count(source.begin(), source.begin() + offset, '\n') + 1) + ", ";
+        }
+        error += "column " + to_string(offset - lineStart + 1) + ")";
+        return nullptr;
+    }
+
+    /**
+     * Reports the current token as out of place, or notes that the input ended too early.
+     */
+    Node* unexpected() {
+        if (atEnd()) {
+            incomplete = true;
+            return nullptr;
+        }
+        return fail("syntax error near unexpected token `" + tokenName() + "'");
+    }
+
+    string tokenName() const {
+        return atEnd() || tokens[pos].text == "\n" ? "newline" : string(tokens[pos].text);
+    }
+
+    /**
+     * Parses a list up to the end of input, a ")", or a "}" closing a group.
+     * @return The only item of a list of one foreground item, otherwise a Sequence, which may be empty.
+     */
+    Node* parseList() {
+        Node* list = newNode(Node::Sequence);
+        skipNewlines();
+        while (!endsList()) {
+            Node* item = parseAndOr();
+            if (!item) return nullptr;
+            list->children.push_back(item);
+            if (isOperator(";") || isOperator("&") || isOperator("\n")) {
+                item->background = tokens[pos].text == "&";
+                pos++;
+                skipNewlines();
+            } else if (!endsList()) {
+                return unexpected();
+            }
+        }
+        if (list->children.size() == 1 && !list->children[0]->background) return list->children[0];
+        if (!list->children.empty()) list->text = spanOf(list->children.front()->text, list->children.back()->text);
+        return list;
+    }
+
+    Node* parseAndOr() {
+        Node* left = parsePipeline();
+        while (left && (isOperator("&&") || isOperator("||"))) {
+            Node* node = newNode(tokens[pos].text == "&&" ? Node::And : Node::Or);
+            pos++;
+            skipNewlines();
+            Node* right = parsePipeline();
+            if (!right) return nullptr;
+            node->children.push_back(left);
+            node->children.push_back(right);
+            node->text = spanOf(left->text, right->text);
+            left = node;
+        }
+        return left;
+    }
+
+    Node* parsePipeline() {
+        Node* pipeline = newNode(Node::Pipeline);
+        size_t start = pos;
+        if (isReserved("!")) {
+            pipeline->negated = true;
+            pos++;
+        }
+        while (isReserved("time") || isReserved("pipesize")) {
+            if (isReserved("time")) { // "time [-j] a | b" reports what each stage cost.
+                pipeline->options.timed = true;
+                pos++;
+                if (isReserved("-j")) {
+                    pipeline->options.timeJson = true;
+                    pos++;
+                }
+            } else { // "pipesize <size> a | b" sets the pipe capacity for one pipeline.
+                pos++;
+                if (atEnd() || tokens[pos].isOperator || !parseSize(string(tokens[pos].text), pipeline->options.pipeSize)) {
+                    return fail("Usage: pipesize <size> command | command ...");
+                }
+                pos++;
+            }
+        }
+        if (pipeline->options.timed && (atEnd() || (tokens[pos].isOperator && tokens[pos].text != "(" && !isRedirection()))) {
+            return fail("Usage: time [-j] command | command ...");
+        }
+
+        bool hasPrefix = pos != start;
+        while (true) {
+            Node* stage = parseCommand();
+            if (!stage) return nullptr;
+            pipeline->children.push_back(stage);
+            if (!isOperator("|")) break;
+            pos++;
+            skipNewlines();
+        }
+        if (!hasPrefix && pipeline->children.size() == 1) return pipeline->children[0]; // A lone command.
+        pipeline->text = spanOf(tokens[start].text, pipeline->children.back()->text);
+        return pipeline;
+    }
+
+    Node* parseCommand() {
+        if (atEnd()) return unexpected();
+        size_t start = pos;
+        bool subshell = isOperator("(");
+        if (subshell || isReserved("{")) {
+            pos++;
+            if (!subshell) groupDepth++;
+            Node* body = parseList();
+            if (!subshell) groupDepth--;
+            if (!body) return nullptr;
+            if (body->kind == Node::Sequence && body->children.empty()) return unexpected(); // "()" or "{ }"
+            if (subshell ? !isOperator(")") : !isReserved("}")) return unexpected();
+            Node* node = newNode(subshell ? Node::Subshell : Node::Group);
+            node->children.push_back(body);
+            pos++;
+            while (!atEnd() && (isRedirection() || isDescriptorNumber())) { // "{ a; b; } > out" opens out once for both.
+                if (!parseRedirection(node)) return nullptr;
+            }
+            node->text = spanOf(tokens[start].text, tokens[pos - 1].text);
+            return node;
+        }
+        if (isReserved("}") || (tokens[pos].isOperator && !isRedirection())) return unexpected();
+
+        Node* command = newNode(Node::Command);
+        while (!atEnd()) {
+            if (!tokens[pos].isOperator && !isDescriptorNumber()) {
+                command->words.push_back(tokens[pos]);
+                pos++;
+                continue;
+            }
+            if (!isRedirection() && !isDescriptorNumber()) break;
+            if (!parseRedirection(command)) return nullptr;
+        }
+        command->text = spanOf(tokens[start].text, tokens[pos - 1].text);
+        return command;
+    }
+
+    /**
+     * Parses one redirection, with the descriptor number written before it, if any.
+     * @param node The command or compound command it applies to.
+     */
+    bool parseRedirection(Node* node) {
+        int fd = -1;
+        if (isDescriptorNumber()) {
+            fd = atoi(string(tokens[pos].text).c_str());
+            pos++;
+        }
+        string_view op = tokens[pos].text;
+        pos++;
+        if (atEnd() || tokens[pos].isOperator) {
+            fail("syntax error near unexpected token `" + tokenName() + "'");
+            return false;
+        }
+        RedirectWord redirect{op[0] == '<' ? STDIN_FILENO : STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC, tokens[pos]};
+        if (fd != -1) redirect.fd = fd;
+        if (op == "<") redirect.flags = O_RDONLY;
+        else if (op == "<>") redirect.flags = O_RDWR | O_CREAT;
+        else if (op == ">>" || op == "&>>") redirect.flags = O_WRONLY | O_CREAT | O_APPEND;
+        else if (op == "<<<") redirect.kind = RedirectWord::HereString;
+        else if (op == "<<" || op == "<<-") redirect.kind = RedirectWord::HereDocument;
+        else if (op == "<&" || op == ">&") redirect.kind = RedirectWord::Duplicate;
+        redirect.stripTabs = op == "<<-";
+        node->redirects.push_back(redirect);
+        if (op[0] == '&') { // &>file is >file 2>&1.
+            static const char standardOutput[] = "1";
+            node->redirects.push_back({STDERR_FILENO, 0, {standardOutput, 0, false, {}}, RedirectWord::Duplicate});
+        }
+        pos++;
+        return true;
+    }
+};
+
+/**
+ * One path component of a glob, compiled for matching. Each element accepts a single character
+ * from its set, or is a "*" accepting any run of characters.
+ */
+struct GlobPattern {
+    struct Element {
+        bool star;
+        bitset<256> accepts;
+    };
+    vector<Element> elements;
+    bool literalDot = false; // Starts with a literal ".", so it may match hidden names.
+
+    /**
+     * Matches a name, backtracking only to the most recent "*", which keeps it linear for
+     * patterns with a single star.
+     */
+    bool matches(string_view name) const {
+        if (!name.empty() && name[0] == '.' && !literalDot) return false; // Hidden names need an explicit ".".
+        size_t p = 0, n = 0, starP = string::npos, starN = 0;
+        while (n < name.size()) {
+            if (p < elements.size() && !elements[p].star && elements[p].accepts.test((unsigned char) name[n])) {
+                p++;
+                n++;
+            } else if (p < elements.size() && elements[p].star) {
+                starP = ++p;
+                starN = n;
+            } else if (starP != string::npos) {
+                p = starP;
+                n = ++starN;
+            } else {
+                return false;
+            }
+        }
+        while (p < elements.size() && elements[p].star) p++;
+        return p == elements.size();
+    }
+};
+
+/**
+ * Finds the "]" closing the bracket expression that starts at pos, or npos if there is none.
+ */
+size_t bracketEnd(string_view pattern, size_t pos) {
+    size_t i = pos + 1;
+    if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) i++;
+    if (i < pattern.size() && pattern[i] == ']') i++; // A leading "]" is a member.
+    for (; i < pattern.size(); ++i) {
+        if (pattern[i] == '\\') i++;
+        else if (pattern[i] == '[' && i + 1 < pattern.size() && pattern[i + 1] == ':') {
+            size_t close = pattern.find(":]", i + 2);
+            if (close != string_view::npos) i = close + 1;
+        } else if (pattern[i] == ']') return i;
+    }
+    return string_view::npos;
+}
+
+/**
+ * Tells whether a pattern, with quoted characters escaped by backslashes, has a *, ? or a
+ * complete bracket expression.
+ */
+bool hasGlobCharacters(string_view pattern) {
+    for (size_t i = 0; i < pattern.size(); ++i) {
+        char c = pattern[i];
+        if (c == '\\') i++;
+        else if (c == '*' || c == '?' || (c == '[' && bracketEnd(pattern, i) != string_view::npos)) return true;
+    }
+    return false;
+}
+
+/**
+ * Adds the characters of a [:name:] class to a set.
+ * @return false if the name is not a class.
+ */
+bool addCharacterClass(string_view name, bitset<256>& set) {
+    static const pair<const char*, int (*)(int)> classes[] = {
+            {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum}, {"upper", isupper},
+            {"lower", islower}, {"space", isspace}, {"blank", isblank}, {"punct", ispunct},
+            {"xdigit", isxdigit}, {"cntrl", iscntrl}, {"print", isprint}, {"graph", isgraph}};
+    for (const auto& entry : classes) {
+        if (name != entry.first) continue;
+        for (int c = 0; c < 256; ++c) {
+            if (entry.second(c)) set.set(c);
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Compiles one path component: *, ?, [set] and [!set] with ranges and [:class:] names, and
+ * backslash escapes. A "[" without its "]" is an ordinary character.
+ */
+GlobPattern compileGlob(string_view component) {
+    GlobPattern pattern;
+    pattern.literalDot = component.compare(0, 1, ".") == 0 || component.compare(0, 2, "\\.") == 0;
+    for (size_t i = 0; i < component.size(); ++i) {
+        GlobPattern::Element element{false, {}};
+        char c = component[i];
+        size_t close;
+        if (c == '*') {
+            if (!pattern.elements.empty() && pattern.elements.back().star) continue; // "**" is the same as "*".
+            element.star = true;
+        } else if (c == '?') {
+            element.accepts.set();
+        } else if (c == '[' && (close = bracketEnd(component, i)) != string_view::npos) {
+            size_t j = i + 1;
+            bool negate = component[j] == '!' || component[j] == '^';
+            if (negate) j++;
+            while (j < close) {
+                if (component[j] == '[' && component[j + 1] == ':' && component.find(":]", j + 2) < close) {
+                    size_t end = component.find(":]", j + 2);
+                    if (!addCharacterClass(component.substr(j + 2, end - j - 2), element.accepts)) element.accepts.set('[');
+                    j = end + 2;
+                    continue;
+                }
+                if (component[j] == '\\' && j + 1 < close) j++;
+                unsigned char low = component[j++];
+                unsigned char high = low;
+                if (j + 1 < close && component[j] == '-') {
+                    j++;
+                    if (component[j] == '\\' && j + 1 < close) j++;
+                    high = component[j++];
+                }
+                for (unsigned ch = low; ch <= high; ++ch) element.accepts.set(ch);
+            }
+            if (negate) element.accepts.flip();
+            i = close;
+        } else {
+            if (c == '\\' && i + 1 < component.size()) c = component[++i];
+            element.accepts.set((unsigned char) c);
+        }
+        pattern.elements.push_back(element);
+    }
+    return pattern;
+}
+
+/**
+ * Removes the backslashes from a pattern component that has no glob characters.
+ */
+string unescapeGlob(string_view component) {
+    string literal;
+    for (size_t i = 0; i < component.size(); ++i) {
+        if (component[i] == '\\' && i + 1 < component.size()) i++;
+        literal += component[i];
+    }
+    return literal;
+}
+
+/**
+ * The names in one directory, read with getdents64.
+ */
+struct DirectoryListing {
+    dev_t device;
+    ino_t inode;
+    struct timespec modified; // The listing is reused only while the directory is unchanged.
+    string names;             // Every name, each followed by a null.
+    struct Entry {
+        uint32_t offset;      // Into names.
+        unsigned char length;
+        unsigned char type;   // d_type, which may be DT_UNKNOWN.
+    };
+    vector<Entry> entries;    // Without "." and "..".
+};
+
+// Directories read while expanding the current command line, keyed by path. Cleared before
+// each line, so globs in one line read a directory once.
+unordered_map<string, DirectoryListing> directoryCache;
+
+/**
+ * Reads a directory through the cache. A cached listing is revalidated with a stat of the
+ * directory, so files created earlier in the same line are seen.
+ * @param path The directory, ending in "/", or empty for the current directory.
+ * @return The listing, or nullptr if the directory cannot be read.
+ */
+const DirectoryListing* readDirectory(const string& path) {
+    const char* name = path.empty() ? "." : path.c_str();
+    struct stat info;
+    if (stat(name, &info) == -1 || !S_ISDIR(info.st_mode)) return nullptr;
+    auto cached = directoryCache.find(path);
+    if (cached != directoryCache.end()) {
+        const DirectoryListing& listing = cached->second;
+        if (listing.device == info.st_dev && listing.inode == info.st_ino &&
+            listing.modified.tv_sec == info.st_mtim.tv_sec && listing.modified.tv_nsec == info.st_mtim.tv_nsec) {
+            return &listing;
+        }
+    }
+    int fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return nullptr;
+    DirectoryListing& listing = directoryCache[path];
+    listing = {info.st_dev, info.st_ino, info.st_mtim, {}, {}};
+
+    static vector<char> buffer(256 * 1024); // Large reads keep huge directories to a few system calls.
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+        for (long offset = 0; offset < n;) {
+            const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            size_t length = strlen(entry->d_name);
+            if (entry->d_name[0] == '.' && (length == 1 || (length == 2 && entry->d_name[1] == '.'))) continue;
+            listing.entries.push_back({uint32_t(listing.names.size()), (unsigned char) length, entry->d_type});
+            listing.names.append(entry->d_name, length + 1);
+        }
+    }
+    close(fd);
+    return &listing;
+}
+
+/**
+ * Tells whether a directory entry is a directory, following symbolic links. Only links and
+ * entries of unknown type need a stat.
+ */
+bool isDirectoryEntry(const string& path, unsigned char type) {
+    if (type == DT_DIR) return true;
+    if (type != DT_UNKNOWN && type != DT_LNK) return false;
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+/**
+ * A file or directory found by walkTree.
+ */
+struct WalkEntry {
+    string path;
+    unsigned char type;  // d_type, resolved with a stat when the file system leaves it unknown.
+    uint64_t blocks = 0; // 512-byte blocks allocated, when sizes were asked for.
+    dev_t device = 0;
+    ino_t inode = 0;
+    bool linked = false; // Has other hard links, so du counts it only once.
+};
+
+/**
+ * What walkTree descends into and returns.
+ */
+struct WalkOptions {
+    bool hidden = true; // Descend into directories whose names start with ".".
+    bool sizes = false; // Stat every entry for its size, as du needs.
+    function<bool(string_view name, unsigned char type)> keep; // Entries to return; every one when empty. Called from several threads.
+};
+
+/**
+ * A walker thread's share of the work: directories waiting to be read, which other threads
+ * steal from the front while the owner takes from the back, and what the thread has found.
+ */
+struct WalkWorker {
+    mutex lock;
+    deque<string> directories; // Each ends in "/", or is empty for the current directory.
+    vector<WalkEntry> found;
+    vector<string> errors;
+};
+
+/**
+ * The threads of one walkTree call. A thread that finds no directory to take parks on the
+ * condition variable until one is queued, the walk is over or it has been cancelled.
+ */
+struct WalkPool {
+    vector<WalkWorker> workers;
+    atomic<size_t> pending{1};      // Directories queued or being read; the walk is over at zero.
+    atomic<size_t> queued{1};       // Directories queued and not yet taken.
+    atomic<unsigned> sleepers{0};   // Threads parked on idle.
+    const atomic<int>* cancelled;   // The caller's stageCancelled: a stage's flag, or Ctrl-C on the main thread.
+    mutex idleLock;
+    condition_variable idle;
+
+    explicit WalkPool(unsigned count) : workers(count), cancelled(stageCancelled) {}
+
+    bool stopped() const { return pending.load() == 0 || (cancelled && cancelled->load(memory_order_relaxed)); }
+
+    /**
+     * Wakes parked threads after a directory was queued (one of them) or the walk stopped (all).
+     */
+    void wake(bool all) {
+        if (sleepers.load() == 0) return;
+        lock_guard<mutex> guard(idleLock); // A thread between its check and its wait would miss the notification.
+        if (all) idle.notify_all();
+        else idle.notify_one();
+    }
+};
+
+/**
+ * Orders paths as a depth-first walk with sorted siblings lists them: "a", "a/b", "a-c".
+ * With parentsLast a directory comes after everything inside it instead, as du reports.
+ */
+bool walkOrderLess(const string& a, const string& b, bool parentsLast) {
+    size_t i = 0, n = min(a.size(), b.size());
+    while (i < n && a[i] == b[i]) i++;
+    auto rank = [&](const string& path) -> int {
+        if (i == path.size()) return parentsLast ? 1 : -1;
+        return path[i] == '/' ? 0 : (unsigned char) path[i] + 2;
+    };
+    return rank(a) < rank(b);
+}
+
+/**
+ * Reads one directory for walkTree, queueing its subdirectories on the worker's own deque.
+ * Entry types come from getdents64, so nothing is stat'ed unless sizes are wanted or the file
+ * system does not report types. Symbolic links are never followed. A cancelled walk stops
+ * between reads.
+ */
+void walkDirectory(const string& directory, const WalkOptions& options, WalkPool& pool,
+                   unsigned self, vector<char>& buffer) {
+    WalkWorker& worker = pool.workers[self];
+    int fd = openat(AT_FDCWD, directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        worker.errors.push_back("'" + (directory.empty() ? "." : directory.substr(0, directory.size() - 1)) + "': " + strerror(errno));
+        return;
+    }
+    long n = 0;
+    while (!pool.stopped() && (n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size())) > 0) {
+        for (long offset = 0; offset < n;) {
+            const struct dirent64* entry = reinterpret_cast<const struct dirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            WalkEntry found;
+            found.type = entry->d_type;
+            if (options.sizes || found.type == DT_UNKNOWN) {
+                struct stat info;
+                if (fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+                    found.type = IFTODT(info.st_mode);
+                    found.blocks = info.st_blocks;
+                    found.device = info.st_dev;
+                    found.inode = info.st_ino;
+                    found.linked = !S_ISDIR(info.st_mode) && info.st_nlink > 1;
+                }
+            }
+            if (found.type == DT_DIR && (options.hidden || name[0] != '.')) {
+                pool.pending++;
+                {
+                    lock_guard<mutex> guard(worker.lock);
+                    worker.directories.push_back(directory + name + "/");
+                }
+                pool.queued++;
+                pool.wake(false);
+            }
+            if (!options.keep || options.keep(name, found.type)) {
+                found.path = directory + name;
+                worker.found.push_back(move(found));
+            }
+        }
+    }
+    if (n == -1 && errno != EINTR) worker.errors.push_back("'" + directory.substr(0, directory.size() - 1) + "': " + strerror(errno));
+    close(fd);
+}
+
+/**
+ * Walks the tree below a directory on a work-stealing pool of up to one thread per core, so
+ * reads of different directories overlap. The result does not depend on how the work was
+ * shared out: entries come back in walkOrderLess order. The walk stops early, with part of
+ * the tree, once the work on the calling thread is cancelled (see inProcessStageCancelled).
+ * @param prefix The directory as it should begin every path: empty for the current
+ *               directory, otherwise ending in "/".
+ * @param entries Receives everything below the directory that options.keep accepts.
+ * @param errors Receives a message for each directory that could not be read.
+ */
+void walkTree(const string& prefix, const WalkOptions& options, vector<WalkEntry>& entries,
+              vector<string>& errors, bool parentsLast = false) {
+    unsigned count = max(1u, min(thread::hardware_concurrency(), 16u));
+    WalkPool pool(count);
+    pool.workers[0].directories.push_back(prefix);
+
+    auto work = [&](unsigned self) {
+        vector<char> buffer(256 * 1024);
+        while (!pool.stopped()) {
+            string directory;
+            bool took = false;
+            for (unsigned i = 0; i < count && !took; ++i) {
+                WalkWorker& victim = pool.workers[(self + i) % count];
+                lock_guard<mutex> guard(victim.lock);
+                if (victim.directories.empty()) continue;
+                if (i == 0) { // Our own deque: newest first, which keeps the walk depth-first.
+                    directory = move(victim.directories.back());
+                    victim.directories.pop_back();
+                } else { // Steal the oldest, which tends to be the largest piece of work.
+                    directory = move(victim.directories.front());
+                    victim.directories.pop_front();
+                }
+                took = true;
+            }
+            if (!took) {
+                unique_lock<mutex> guard(pool.idleLock);
+                pool.sleepers++;
+                pool.idle.wait(guard, [&] { return pool.queued.load() != 0 || pool.stopped(); });
+                pool.sleepers--;
+                continue;
+            }
+            pool.queued--;
+            walkDirectory(directory, options, pool, self, buffer);
+            if (--pool.pending == 0 || pool.stopped()) pool.wake(true);
+        }
+    };
+    vector<thread> threads;
+    for (unsigned i = 1; i < count; ++i) {
+        threads.emplace_back([&work, i] {
+            blockInterrupts(); // Ctrl-C must land on the calling thread, whose flag the pool checks.
+            work(i);
+        });
+    }
+    work(0);
+    for (thread& t : threads) t.join();
+
+    for (WalkWorker& worker : pool.workers) {
+        for (WalkEntry& entry : worker.found) entries.push_back(move(entry));
+        errors.insert(errors.end(), worker.errors.begin(), worker.errors.end());
+    }
+    sort(entries.begin(), entries.end(), [parentsLast](const WalkEntry& a, const WalkEntry& b) {
+        return walkOrderLess(a.path, b.path, parentsLast);
+    });
+}
+
+/**
+ * Expands a glob pattern against the file system, one path component at a time. Components
+ * without glob characters are taken as written; the others are matched against the cached
+ * directory listings. A "**" component matches any number of directories, which are found with
+ * walkTree; followed by a last component, the tree is walked once with that as the filter.
+ * Hidden directories are not descended into. A trailing "/" matches directories only.
+ * @param pattern The pattern, with quoted characters escaped by backslashes.
+ * @param fields Receives the matching paths, sorted bytewise.
+ * @return The number of paths added; none means the word is kept as written.
+ */
+size_t expandGlob(string_view pattern, vector<string>& fields) {
+    if (!hasGlobCharacters(pattern)) return 0;
+    size_t pos = pattern.find_first_not_of('/');
+    if (pos == string_view::npos) return 0;
+    vector<string> paths = {pos ? string(pattern.substr(0, pos)) : string()}, next;
+    while (!paths.empty()) {
+        size_t end = min(pattern.find('/', pos), pattern.size());
+        size_t after = pattern.find_first_not_of('/', end);
+        bool last = after == string_view::npos;
+        bool directoryOnly = end < pattern.size(); // Followed by a slash.
+        string_view component = pattern.substr(pos, end - pos);
+        next.clear();
+        if (component == "**") {
+            size_t finalEnd = last ? end : min(pattern.find('/', after), pattern.size());
+            bool finalComponent = last || pattern.find_first_not_of('/', finalEnd) == string_view::npos;
+            bool finalDirectoryOnly = last ? directoryOnly : finalEnd < pattern.size();
+            GlobPattern compiled = compileGlob(last ? "*" : pattern.substr(after, finalEnd - after));
+            WalkOptions options;
+            options.hidden = false;
+            if (finalComponent) {
+                options.keep = [&compiled](string_view name, unsigned char) { return compiled.matches(name); };
+            } else {
+                options.keep = [](string_view name, unsigned char type) { return type == DT_DIR && name[0] != '.'; };
+            }
+            vector<string> errors;
+            for (const string& path : paths) {
+                if (!finalComponent) next.push_back(path); // "**" also matches no directory at all.
+                vector<WalkEntry> entries;
+                walkTree(path, options, entries, errors);
+                for (WalkEntry& entry : entries) {
+                    bool directory = finalComponent && finalDirectoryOnly ? isDirectoryEntry(entry.path, entry.type) : entry.type == DT_DIR;
+                    if (finalComponent && finalDirectoryOnly && !directory) continue;
+                    next.push_back(!finalComponent || finalDirectoryOnly ? move(entry.path) + "/" : move(entry.path));
+                }
+            }
+            paths.swap(next);
+            if (finalComponent) break;
+            pos = after;
+            continue;
+        } else if (!hasGlobCharacters(component)) {
+            string literal = unescapeGlob(component);
+            for (const string& path : paths) {
+                string candidate = path + literal;
+                struct stat info;
+                if (last && (directoryOnly ? stat(candidate.c_str(), &info) == -1 || !S_ISDIR(info.st_mode)
+                                           : lstat(candidate.c_str(), &info) == -1)) {
+                    continue;
+                }
+                next.push_back(directoryOnly ? candidate + "/" : candidate);
+            }
+        } else {
+            GlobPattern compiled = compileGlob(component);
+            for (const string& path : paths) {
+                const DirectoryListing* listing = readDirectory(path);
+                if (!listing) continue;
+                for (const DirectoryListing::Entry& entry : listing->entries) {
+                    string_view name(listing->names.data() + entry.offset, entry.length);
+                    if (!compiled.matches(name)) continue;
+                    string candidate = path;
+                    candidate.append(name);
+                    if (directoryOnly) {
+                        if (!isDirectoryEntry(candidate, entry.type)) continue;
+                        candidate += '/';
+                    }
+                    next.push_back(move(candidate));
+                }
+            }
+        }
+        paths.swap(next);
+        if (last) break;
+        pos = after;
+    }
+    sort(paths.begin(), paths.end());
+    for (string& path : paths) fields.push_back(move(path));
+    return paths.size();
+}
+
+/**
+ * How far parsing a command line got.
+ */
+enum class ParseStatus { Complete, Incomplete, Error };
+
+/**
+ * Lexes and parses a command line into commandArena, which is reset first. Errors are reported
+ * here and set $? to 2.
+ * @param line The command line, which must outlive the tree; it may span several lines.
+ * @param program Receives the tree, or nullptr for a blank line or an error.
+ * @param nested Set for the command of a substitution, which is parsed alongside the line it
+ *               is part of, so the arena is not reset.
+ * @return Incomplete if the line ends in the middle of a command and should be continued.
+ */
+ParseStatus parseCommandLine(string_view line, Node*& program, bool nested = false) {
+    if (!nested) {
+        commandArena.reset(); // Nothing from the previous line is still in use.
+        directoryCache.clear();
+    }
+    program = nullptr;
+    ArenaVector<Token> tokens;
+    if (!lexLine(line, tokens)) return ParseStatus::Incomplete;
+    Parser parser{tokens, line, 0, {}, false, 0};
+    Node* list = parser.parseList();
+    if (list && !parser.atEnd()) list = parser.unexpected(); // A ")" without its "(".
+    if (parser.incomplete) return ParseStatus::Incomplete;
+    if (!list) {
+        cerr << parser.error << endl;
+        lastExitStatus = 2;
+        return ParseStatus::Error;
+    }
+    if (list->kind != Node::Sequence || !list->children.empty()) program = list;
+    return ParseStatus::Complete;
+}
+
+/**
+ * A redirection after expansion.
+ */
+struct Redirection {
+    enum Kind {
+        File,      // Opens path.
+        Data,      // Serves path itself, from a here-document or here-string.
+        Duplicate, // Makes fd a copy of source, as in 2>&1.
+        Close      // Closes fd, as in 3>&-.
+    };
+    int fd;      // The command's descriptor it replaces.
+    int flags;   // open() flags for its file.
+    string path;
+    Kind kind = File;
+    int source = -1;
+};
+
+/**
+ * A simple command after expansion, ready to run.
+ */
+struct SimpleCommand {
+    vector<string> args;
+    vector<string> assignments; // Leading "name=value" words, which only the launched command sees.
+    vector<Redirection> redirections;
+    string_view text; // As written, for "jobs".
+    size_t spreadBegin = 0, spreadEnd = 0; // The args from the word that expanded to the most, which argument batching shares out.
+};
+
+/**
+ * Returns the status of one pipeline stage as text, or an empty string for an index past the end.
+ */
+string pipeStatusAt(const string& index) {
+    size_t i = strtoul(index.c_str(), nullptr, 10);
+    return i < pipeStatus.size() ? to_string(pipeStatus[i]) : "";
+}
+
+/**
+ * Expands the parameter starting with the "$" at pos: $?, $NAME, ${NAME} or ${PIPESTATUS[n]},
+ * where n may be @ or * for every stage. $PIPESTATUS is the status of the first stage, and a
+ * variable that is not set expands to nothing.
+ * @param value Receives the expansion.
+ * @return The length of the parameter, or 0 if it is not one the shell knows, in which case it stays as written.
+ */
+size_t expandParameter(string_view word, size_t pos, string& value) {
+    string_view rest = word.substr(pos);
+    if (rest.compare(0, 2, "$?") == 0) {
+        value = to_string(lastExitStatus);
+        return 2;
+    }
+    if (rest.compare(0, 13, "${PIPESTATUS[") == 0 && rest.find("]}") != string_view::npos) {
+        size_t close = rest.find("]}");
+        string index(rest.substr(13, close - 13));
+        if (index == "@" || index == "*") {
+            for (size_t n = 0; n < pipeStatus.size(); ++n) value += (n ? " " : "") + to_string(pipeStatus[n]);
+        } else {
+            value = pipeStatusAt(index);
+        }
+        return close + 2;
+    }
+    string_view name;
+    size_t length;
+    if (rest.compare(0, 2, "${") == 0) {
+        size_t close = rest.find('}');
+        if (close == string_view::npos) return 0;
+        name = rest.substr(2, close - 2);
+        length = close + 1;
+    } else {
+        length = 1;
+        while (length < rest.size() && (isalnum((unsigned char) rest[length]) || rest[length] == '_')) length++;
+        name = rest.substr(1, length - 1);
+    }
+    if (!isValidName(name)) return 0;
+    if (name == "PIPESTATUS") {
+        value = pipeStatusAt("0");
+    } else if (const char* variable = variableValue(name)) {
+        value = variable;
+    }
+    return length;
+}
+
+void substituteCommand(string_view text, bool backquoted, string& output);
+string substituteProcess(string_view text, bool reading);
+
+/**
+ * Expands a word as written into fields: parameters, command substitutions and process
+ * substitutions are replaced, then quotes and backslashes removed. The result of an unquoted expansion is split into fields at whitespace, so
+ * ${PIPESTATUS[@]} gives one argument per stage; quoted text is never split. A field with an
+ * unquoted *, ? or [ is then replaced by the paths it matches, if there are any.
+ * @param word The word, with balanced quotes as the lexer guarantees.
+ * @param fields Receives the fields; a word that expands to nothing unquoted adds none.
+ * @param split false for the value of an assignment, which always becomes exactly one field.
+ */
+void expandWord(string_view word, vector<string>& fields, bool split = true) {
+    string field, value;
+    static string pattern; // The field with its quoted glob characters escaped, for expandGlob.
+    pattern.clear();
+    bool hasField = false; // Quotes make a field even when it is empty.
+    bool hasGlob = false;
+    bool inDouble = false;
+    auto append = [&](string_view text, bool quoted) {
+        field.append(text);
+        for (char t : text) {
+            if (quoted && (t == '*' || t == '?' || t == '[' || t == '\\')) pattern += '\\';
+            else if (!quoted && (t == '*' || t == '?' || t == '[')) hasGlob = true;
+            pattern += t;
+        }
+        hasField = true;
+    };
+    auto endField = [&]() {
+        if (!hasGlob || !split || expandGlob(pattern, fields) == 0) fields.push_back(move(field));
+        field.clear();
+        pattern.clear();
+        hasField = hasGlob = false;
+    };
+    size_t i = 0, length;
+    while (i < word.size()) {
+        char c = word[i];
+        if (c == '\'' && !inDouble) {
+            size_t close = word.find('\'', i + 1);
+            append(word.substr(i + 1, close - i - 1), true);
+            i = close + 1;
+        } else if (c == '"') {
+            inDouble = !inDouble;
+            hasField = true;
+            i++;
+        } else if (c == '\\' && i + 1 < word.size()) {
+            char next = word[i + 1];
+            if (next != '\n') { // A backslash-newline joins the lines.
+                if (inDouble && !strchr("$`\"\\", next)) append("\\", true);
+                append(word.substr(i + 1, 1), true);
+            }
+            i += 2;
+        } else if (c == '`' || (c == '$' && i + 1 < word.size() && word[i + 1] == '(') ||
+                   (c == '$' && (length = expandParameter(word, i, value)) != 0)) {
+            if (c == '`' || word[i + 1] == '(') {
+                size_t end = i;
+                skipQuoted(word, end); // The lexer made sure it is closed.
+                string saved = pattern; // The command's own expansions reuse it.
+                if (c == '`') substituteCommand(word.substr(i + 1, end - i - 2), true, value);
+                else substituteCommand(word.substr(i + 2, end - i - 3), false, value);
+                pattern = saved;
+                length = end - i;
+            }
+            if (inDouble || !split) {
+                append(value, inDouble);
+            } else {
+                for (size_t v = 0; v < value.size(); ++v) { // Unquoted, so split at whitespace.
+                    if (!isspace((unsigned char) value[v])) append(string_view(value).substr(v, 1), false);
+                    else if (hasField) endField();
+                }
+            }
+            value.clear();
+            i += length;
+        } else if (!inDouble && startsProcessSubstitution(word.data(), i, word.size())) {
+            size_t end = i;
+            skipQuoted(word, end);
+            string saved = pattern;
+            string path = substituteProcess(word.substr(i + 2, end - i - 3), c == '<');
+            pattern = saved;
+            append(path, true); // A /dev/fd path, never split or matched.
+            i = end;
+        } else {
+            append(word.substr(i, 1), inDouble);
+            i++;
+        }
+    }
+    if (hasField || !split) endField();
+}
+
+/**
+ * Expands the body of a here-document whose delimiter was not quoted. Parameters and command
+ * substitutions are replaced, and a backslash only escapes "$", "`", "\\" or a newline; quotes
+ * are ordinary characters and nothing is split or globbed.
+ * @param body The lines up to the delimiter.
+ * @return The expanded text.
+ */
+string expandHereDocument(string_view body) {
+    string text, value;
+    size_t i = 0, length;
+    while (i < body.size()) {
+        char c = body[i];
+        if (c == '\\' && i + 1 < body.size() && strchr("$`\\\n", body[i + 1])) {
+            if (body[i + 1] != '\n') text += body[i + 1];
+            i += 2;
+        } else if (c == '`' || (c == '$' && i + 1 < body.size() && body[i + 1] == '(')) {
+            size_t end = i;
+            if (!skipQuoted(body, end)) { // Never closed, so it stays as written.
+                text.append(body.substr(i));
+                break;
+            }
+            if (c == '`') substituteCommand(body.substr(i + 1, end - i - 2), true, value);
+            else substituteCommand(body.substr(i + 2, end - i - 3), false, value);
+            text += value;
+            value.clear();
+            i = end;
+        } else if (c == '$' && (length = expandParameter(body, i, value)) != 0) {
+            text += value;
+            value.clear();
+            i += length;
+        } else {
+            text += c;
+            i++;
+        }
+    }
+    return text;
+}
+
+/**
+ * Checks whether a command is a plain "cat" of files, which the shell can perform itself.
+ * Commands with options, or "-" for stdin, are left to the real cat.
+ * @param args The command and its arguments, without redirections.
+ */
+bool isPlainCat(const vector<string>& args) {
+    if (args.empty() || args[0] != "cat") return false;
+    return all_of(args.begin() + 1, args.end(), [](const string& arg) { return arg.empty() || arg[0] != '-'; });
+}
+
+/**
+ * Copies everything from one descriptor to another while keeping the data inside the kernel
+ * where possible: splice when the destination is a pipe, otherwise copy_file_range and then
+ * sendfile. A plain read/write loop is the last resort when neither side supports them.
+ * @return 0 on success, otherwise the errno of the failed transfer; EPIPE means the reader went away
+ *         and ECANCELED that the shell stopped the stage.
+ */
+int copyDescriptor(int in, int out, bool outIsPipe) {
+    const size_t chunk = 1 << 20;
+    bool copied = false; // Once data has moved, a failure is real rather than a missing kernel feature.
+    ssize_t n;
+
+    if (outIsPipe) {
+        while ((n = splice(in, nullptr, out, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+            if (inProcessStageCancelled()) return ECANCELED;
+            if (n > 0) {
+                copied = true;
+                splicedBytes += n;
+            } else if (errno != EINTR) {
+                if (copied || (errno != EINVAL && errno != ENOSYS)) return errno;
+                break;
+            }
+        }
+        if (n == 0) return 0;
+    } else {
+        while ((n = copy_file_range(in, nullptr, out, nullptr, chunk, 0)) != 0) {
+            if (inProcessStageCancelled()) return ECANCELED;
+            if (n > 0) {
+                copied = true;
+            } else if (errno != EINTR) {
+                if (copied || (errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+                               errno != EOPNOTSUPP && errno != EBADF)) return errno;
+                break;
+            }
+        }
+        if (n == 0) return 0;
+        while ((n = sendfile(out, in, nullptr, chunk)) != 0) {
+            if (inProcessStageCancelled()) return ECANCELED;
+            if (n > 0) {
+                copied = true;
+            } else if (errno != EINTR) {
+                if (copied || (errno != EINVAL && errno != ENOSYS)) return errno;
+                break;
+            }
+        }
+        if (n == 0) return 0;
+    }
+
+    char buffer[65536];
+    while ((n = read(in, buffer, sizeof(buffer))) != 0) {
+        if (inProcessStageCancelled()) return ECANCELED;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        for (ssize_t written = 0; written < n;) {
+            ssize_t w = write(out, buffer + written, n - written);
+            if (w == -1) {
+                if (errno != EINTR) return errno;
+                if (inProcessStageCancelled()) return ECANCELED;
+                continue;
+            }
+            written += w;
+        }
+    }
+    return 0;
+}
+
+/**
+ * The in-process cat: copies each file, or the input descriptor when no files are named, to out.
+ * Errors are reported the way cat reports them.
+ * @param files The files to concatenate.
+ * @param inputFd Standard input for cat, used only when files is empty.
+ * @param out The destination descriptor.
+ * @return cat's exit status, 141 if the reader of a pipe went away as with SIGPIPE.
+ */
+int catFiles(const vector<string>& files, int inputFd, int out) {
+    struct stat outInfo = {};
+    fstat(out, &outInfo);
+    bool outIsPipe = S_ISFIFO(outInfo.st_mode);
+    int status = 0;
+
+    auto copyFrom = [&](int in, const string& name) {
+        struct stat inInfo;
+        if (S_ISREG(outInfo.st_mode) && fstat(in, &inInfo) == 0 && S_ISREG(inInfo.st_mode) &&
+            inInfo.st_dev == outInfo.st_dev && inInfo.st_ino == outInfo.st_ino) {
+            cerr << "cat: " << name << ": input file is output file" << endl;
+            status = 1;
+            return true;
+        }
+        int error = copyDescriptor(in, out, outIsPipe);
+        if (error == EPIPE || error == ECANCELED) {
+            status = 128 + (error == EPIPE ? SIGPIPE : inProcessStageCancelled());
+            return false;
+        }
+        if (error != 0) {
+            cerr << "cat: " << name << ": " << strerror(error) << endl;
+            status = 1;
+        }
+        return true;
+    };
+
+    if (files.empty()) {
+        copyFrom(inputFd, "-");
+        return status;
+    }
+    for (const string& file : files) {
+        int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            cerr << "cat: " << file << ": " << strerror(errno) << endl;
+            status = 1;
+            continue;
+        }
+        bool keepGoing = copyFrom(in, file);
+        close(in);
+        if (!keepGoing) break;
+    }
+    return status;
+}
+
+/**
+ * Makes a readable descriptor holding inline data. Small payloads are written into a pipe,
+ * which holds them without blocking. Larger ones go into a memfd that is sealed against any
+ * change and reopened read-only, so the command reads them from memory without a writer
+ * thread and without touching the disk; an unlinked file in /tmp stands in where memfd_create
+ * is missing.
+ * @param data The bytes to serve.
+ * @return A close-on-exec descriptor positioned at the start, or -1 with errno set.
+ */
+int openInlineData(const string& data) {
+    if (data.size() <= 4096) { // At most PIPE_BUF, which always fits in an empty pipe.
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+        bool written = data.empty() || write(fds[1], data.data(), data.size()) == (ssize_t) data.size();
+        int error = errno;
+        close(fds[1]);
+        if (!written) {
+            close(fds[0]);
+            errno = error;
+            return -1;
+        }
+        return fds[0];
+    }
+    int fd = memfd_create("mish-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1 && (fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) == -1) return -1;
+    for (size_t done = 0; done < data.size();) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            int error = n == 0 ? EIO : errno;
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        done += n;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    int readOnly = open(("/proc/self/fd/" + to_string(fd)).c_str(), O_RDONLY | O_CLOEXEC);
+    if (readOnly != -1) {
+        close(fd);
+        return readOnly;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/**
+ * Opens a redirection's file in the shell, close-on-exec and above the user's descriptors,
+ * reporting a failure. Inline data from a here-document or here-string is served by
+ * openInlineData.
+ * @return The descriptor, or -1.
+ */
+int openRedirection(const Redirection& redirection) {
+    if (redirection.kind == Redirection::Data) {
+        int fd = openInlineData(redirection.path);
+        if (fd == -1) cerr << "mish: here-document: " << strerror(errno) << endl;
+        return moveShellFd(fd);
+    }
+    int fd = open(redirection.path.c_str(), redirection.flags | O_CLOEXEC, 0644);
+    if (fd == -1) cerr << "mish: " << redirection.path << ": " << strerror(errno) << endl;
+    return moveShellFd(fd);
+}
+
+/**
+ * Tells whether a descriptor is open in the shell for its own use: close-on-exec, so no
+ * command inherits it. The standard descriptors, those opened with exec and process
+ * substitutions are not.
+ */
+bool isShellFd(int fd) {
+    int flags = fcntl(fd, F_GETFD);
+    return flags != -1 && (flags & FD_CLOEXEC);
+}
+
+/**
+ * Opens a command's redirections in the shell, before anything is launched, and turns them
+ * into actions for the child in the order they were written: each opened file is copied onto
+ * its descriptor, ">&" copies another descriptor and ">&-" closes one. So "2>&1 >out" and
+ * ">out 2>&1" differ as in sh, and a failure is reported without starting anything.
+ * @param actions Receives the actions, after any already there, such as pipe plumbing.
+ * @param opened Receives the descriptors opened in the shell, to close once the command is launched.
+ * @return false if a file could not be opened or a descriptor to copy is not open; nothing is left open then.
+ */
+bool redirectionActions(const vector<Redirection>& redirections, FdActions& actions, ArenaVector<int>& opened) {
+    for (const Redirection& redirection : redirections) {
+        if (redirection.kind == Redirection::Close) {
+            actions.push_back(closeAction(redirection.fd));
+            continue;
+        }
+        if (redirection.kind == Redirection::Duplicate) {
+            auto set = find_if(actions.rbegin(), actions.rend(), [&](const FdAction& action) { return action.fd == redirection.source; });
+            bool open = set != actions.rend() ? set->kind != FdAction::Close : fcntl(redirection.source, F_GETFD) != -1 && !isShellFd(redirection.source);
+            if (!open) {
+                cerr << "mish: " << redirection.source << ": " << strerror(EBADF) << endl;
+                for (int fd : opened) close(fd);
+                opened.clear();
+                return false;
+            }
+            actions.push_back(dupAction(redirection.source, redirection.fd));
+            continue;
+        }
+        int fd = openRedirection(redirection);
+        if (fd == -1) {
+            for (int descriptor : opened) close(descriptor);
+            opened.clear();
+            return false;
+        }
+        opened.push_back(fd);
+        actions.push_back(dupAction(fd, redirection.fd));
+    }
+    return true;
+}
+
+/**
+ * Works out where standard input and output end up after a list of actions, for a command
+ * that runs inside the shell and so has nobody to apply them.
+ * @param in The shell's descriptor the command starts reading, or -1 for none; updated.
+ * @param out The descriptor it starts writing; updated, -1 if it was closed.
+ */
+void followActions(const FdActions& actions, int& in, int& out) {
+    ArenaVector<pair<int, int>> table = {{STDIN_FILENO, in}, {STDOUT_FILENO, out}}; // The command's descriptor and the shell's behind it.
+    auto lookup = [&table](int fd) {
+        for (auto it = table.rbegin(); it != table.rend(); ++it) {
+            if (it->first == fd) return it->second;
+        }
+        return fd;
+    };
+    for (const FdAction& action : actions) table.push_back({action.fd, action.kind == FdAction::Dup ? lookup(action.source) : -1});
+    in = lookup(STDIN_FILENO);
+    out = lookup(STDOUT_FILENO);
+}
+
+/**
+ * Applies descriptor actions to the shell itself, for exec and for a redirected { } group,
+ * whose builtins then write to the new descriptors and whose commands inherit them.
+ * @param opened The descriptors the actions' files were opened on, which they may replace.
+ * @param saved If not null, receives each changed descriptor with a copy of what it was, or
+ *              -1 if it was closed, in the order restoreShellFds needs.
+ * @return false if an action would replace one of the shell's own descriptors; it is skipped and reported.
+ */
+bool applyShellActions(const FdActions& actions, const ArenaVector<int>& opened, vector<pair<int, int>>* saved) {
+    cout << flush; // Written where standard output pointed so far.
+    bool applied = true;
+    for (const FdAction& action : actions) {
+        if (isShellFd(action.fd) && find(opened.begin(), opened.end(), action.fd) == opened.end()) {
+            cerr << "mish: " << action.fd << ": descriptor in use by the shell" << endl;
+            applied = false;
+            continue;
+        }
+        if (saved && none_of(saved->begin(), saved->end(), [&](const pair<int, int>& entry) { return entry.first == action.fd; })) {
+            saved->push_back({action.fd, fcntl(action.fd, F_DUPFD_CLOEXEC, firstShellFd)});
+        }
+        if (action.kind == FdAction::Close) close(action.fd);
+        else if (action.source == action.fd) fcntl(action.fd, F_SETFD, 0);
+        else dup2(action.source, action.fd);
+    }
+    return applied;
+}
+
+/**
+ * Puts back the descriptors applyShellActions changed, in reverse order.
+ */
+void restoreShellFds(vector<pair<int, int>>& saved) {
+    cout << flush;
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+        if (it->second == -1) {
+            close(it->first);
+        } else {
+            dup2(it->second, it->first);
+            close(it->second);
+        }
+    }
+    saved.clear();
+}
+
+/**
+ * Checks for "cat [files] [< in] > out", which the shell copies itself instead of launching cat.
+ * @param command The expanded command.
+ */
+bool isCatCopy(const SimpleCommand& command) {
+    bool hasInput = false, hasOutput = false;
+    for (const Redirection& redirection : command.redirections) {
+        if (redirection.fd > STDOUT_FILENO) return false; // Its error output goes elsewhere, which a child handles.
+        (redirection.fd == STDIN_FILENO ? hasInput : hasOutput) = true;
+    }
+    return hasOutput && isPlainCat(command.args) && (command.args.size() > 1 || hasInput);
+}
+
+/**
+ * Runs "cat [files] [< in] > out" inside the shell. The data is copied in the kernel with
+ * copy_file_range or sendfile, without a fork, an exec or a user-space copy.
+ * @param command The expanded command, already checked with isCatCopy.
+ * @return The exit status.
+ */
+int executeCatCopy(const SimpleCommand& command) {
+    vector<string> files(command.args.begin() + 1, command.args.end());
+    FdActions actions;
+    ArenaVector<int> opened;
+    if (!redirectionActions(command.redirections, actions, opened)) return 1;
+    int in = -1, out = STDOUT_FILENO;
+    followActions(actions, in, out);
+    InterruptScope interrupt; // The copy runs on the main thread, which Ctrl-C interrupts.
+    int status = catFiles(files, in, out);
+    for (int fd : opened) close(fd);
+    if (interrupt.interrupted()) {
+        cout << endl;
+        lineInterrupted = true;
+    }
+    return status;
+}
+
+/**
+ * Output of an in-process builtin. Text is gathered as an iovec list and written with writev,
+ * either when the batch fills up or when the builtin finishes. Both the list and the copies
+ * of generated text live inside the object, so writing output never allocates.
+ */
+struct BuiltinOutput {
+    int fd;
+    iovec pending[64];       // Pieces waiting to be written.
+    int pendingCount = 0;
+    char scratch[4096];      // Storage for pieces built by the builtin itself.
+    size_t scratchUsed = 0;
+    int error = 0;           // errno of the first failed write.
+
+    explicit BuiltinOutput(int fd) : fd(fd) {}
+    ~BuiltinOutput() { flush(); }
+
+    /**
+     * Queues bytes that stay valid until the next flush, such as an argument, without copying them.
+     */
+    void reference(const char* data, size_t size) {
+        if (size == 0) return;
+        if (pendingCount == 64) flush();
+        pending[pendingCount++] = {const_cast<char*>(data), size};
+    }
+
+    void reference(const string& text) { reference(text.data(), text.size()); }
+
+    /**
+     * Queues a copy of text produced by the builtin. Text too large for the scratch buffer is
+     * written straight away instead.
+     */
+    void append(string_view text) {
+        if (text.size() > sizeof(scratch)) {
+            reference(text.data(), text.size());
+            flush();
+            return;
+        }
+        if (scratchUsed + text.size() > sizeof(scratch) || pendingCount == 64) flush(); // Flushing empties the scratch buffer.
+        memcpy(scratch + scratchUsed, text.data(), text.size());
+        reference(scratch + scratchUsed, text.size());
+        scratchUsed += text.size();
+    }
+
+    /**
+     * Writes everything queued, continuing after partial writes.
+     * @return false once a write has failed.
+     */
+    bool flush() {
+        int next = 0;
+        while (next < pendingCount && error == 0) {
+            ssize_t written = writev(fd, &pending[next], pendingCount - next);
+            if (written == -1) {
+                if (errno != EINTR) error = errno;
+                continue;
+            }
+            while (written > 0) { // Skip whole pieces, then trim a partly written one.
+                if ((size_t) written >= pending[next].iov_len) {
+                    written -= pending[next++].iov_len;
+                } else {
+                    pending[next].iov_base = (char*) pending[next].iov_base + written;
+                    pending[next].iov_len -= written;
+                    written = 0;
+                }
+            }
+        }
+        pendingCount = 0;
+        scratchUsed = 0;
+        return error == 0;
+    }
+};
+
+/**
+ * Appends the character for a backslash escape as understood by "echo -e" and printf.
+ * @param text The text containing the escape.
+ * @param i The index of the backslash; advanced past the escape.
+ * @param result Receives the character.
+ * @param octalNeedsZero Whether octal escapes are written \0nnn (echo) rather than \nnn (printf).
+ * @return false for \c, which ends the output.
+ */
+bool appendEscape(const string& text, size_t& i, string& result, bool octalNeedsZero) {
+    char c = i + 1 < text.size() ? text[i + 1] : '\\';
+    i += 2;
+    switch (c) {
+        case 'a': result += '\a'; return true;
+        case 'b': result += '\b'; return true;
+        case 'c': return false;
+        case 'e': result += '\033'; return true;
+        case 'f': result += '\f'; return true;
+        case 'n': result += '\n'; return true;
+        case 'r': result += '\r'; return true;
+        case 't': result += '\t'; return true;
+        case 'v': result += '\v'; return true;
+        case '\\': result += '\\'; return true;
+        case 'x': {
+            int value = 0, digits = 0;
+            while (digits < 2 && i < text.size() && isxdigit((unsigned char) text[i])) {
+                value = value * 16 + (isdigit((unsigned char) text[i]) ? text[i] - '0' : tolower(text[i]) - 'a' + 10);
+                i++, digits++;
+            }
+            if (digits == 0) result += "\\x";
+            else result += (char) value;
+            return true;
+        }
+        default:
+            if (c >= '0' && c <= '7' && (c == '0' || !octalNeedsZero)) {
+                int value = 0, digits = 0;
+                i -= 1;
+                if (octalNeedsZero) i++; // The leading 0 only introduces the escape.
+                while (digits < 3 && i < text.size() && text[i] >= '0' && text[i] <= '7') {
+                    value = value * 8 + (text[i++] - '0');
+                    digits++;
+                }
+                result += (char) value;
+                return true;
+            }
+            result += '\\';
+            result += c;
+            return true;
+    }
+}
+
+/**
+ * echo [-neE] [arg ...]: writes the arguments separated by spaces. -n drops the newline,
+ * -e interprets backslash escapes and -E turns them off again.
+ */
+int builtinEcho(const vector<string>& args, BuiltinOutput& out) {
+    bool newline = true, escapes = false;
+    size_t i = 1;
+    for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; ++i) {
+        const string& option = args[i];
+        if (option.find_first_not_of("neE", 1) != string::npos) break; // Not an option, print it.
+        for (size_t j = 1; j < option.size(); ++j) {
+            if (option[j] == 'n') newline = false;
+            else if (option[j] == 'e') escapes = true;
+            else escapes = false;
+        }
+    }
+    for (size_t first = i; i < args.size(); ++i) {
+        if (i > first) out.reference(" ", 1);
+        if (!escapes || args[i].find('\\') == string::npos) {
+            out.reference(args[i]);
+            continue;
+        }
+        string expanded;
+        for (size_t j = 0; j < args[i].size();) {
+            if (args[i][j] != '\\') {
+                expanded += args[i][j++];
+            } else if (!appendEscape(args[i], j, expanded, true)) {
+                out.append(expanded);
+                return 0;
+            }
+        }
+        out.append(expanded);
+    }
+    if (newline) out.reference("\n", 1);
+    return 0;
+}
+
+/**
+ * printf format [arg ...]: formats the arguments like printf(1). The format is reused until
+ * all arguments are consumed; missing arguments count as empty or zero.
+ */
+int builtinPrintf(const vector<string>& args, BuiltinOutput& out) {
+    if (args.size() < 2) {
+        cerr << "printf: usage: printf format [arguments]" << endl;
+        return 2;
+    }
+    const string& format = args[1];
+    size_t next = 2;
+    int status = 0;
+    auto nextArg = [&]() -> const string* { return next < args.size() ? &args[next++] : nullptr; };
+    auto toInteger = [&](const string* arg) -> long long {
+        if (!arg || arg->empty()) return 0;
+        if (((*arg)[0] == '\'' || (*arg)[0] == '"') && arg->size() > 1) return (unsigned char) (*arg)[1];
+        char* end;
+        errno = 0;
+        long long value = strtoll(arg->c_str(), &end, 0);
+        if (*end != '\0' || errno != 0) {
+            cerr << "mish: printf: " << *arg << ": invalid number" << endl;
+            status = 1;
+        }
+        return value;
+    };
+
+    do {
+        string result;
+        for (size_t i = 0; i < format.size();) {
+            if (format[i] == '\\') {
+                if (!appendEscape(format, i, result, false)) {
+                    out.append(result);
+                    return status;
+                }
+                continue;
+            }
+            if (format[i] != '%') {
+                result += format[i++];
+                continue;
+            }
+            if (i + 1 < format.size() && format[i + 1] == '%') {
+                result += '%';
+                i += 2;
+                continue;
+            }
+
+            // Collect "%[flags][width][.precision]conversion", resolving * from the arguments.
+            string spec = "%";
+            size_t j = i + 1;
+            while (j < format.size() && strchr("-+ #0", format[j])) spec += format[j++];
+            for (int part = 0; part < 2; ++part) {
+                if (part == 1) {
+                    if (j >= format.size() || format[j] != '.') break;
+                    spec += format[j++];
+                }
+                if (j < format.size() && format[j] == '*') {
+                    spec += to_string(toInteger(nextArg()));
+                    j++;
+                } else {
+                    while (j < format.size() && isdigit((unsigned char) format[j])) spec += format[j++];
+                }
+            }
+            if (j >= format.size()) {
+                result += format.substr(i);
+                break;
+            }
+            char conversion = format[j];
+            i = j + 1;
+            char buffer[512];
+            const string* arg;
+            switch (conversion) {
+                case 'd': case 'i':
+                    snprintf(buffer, sizeof(buffer), (spec + "lld").c_str(), toInteger(nextArg()));
+                    result += buffer;
+                    break;
+                case 'u': case 'o': case 'x': case 'X':
+                    snprintf(buffer, sizeof(buffer), (spec + "ll" + conversion).c_str(),
+                             (unsigned long long) toInteger(nextArg()));
+                    result += buffer;
+                    break;
+                case 'c':
+                    arg = nextArg();
+                    snprintf(buffer, sizeof(buffer), (spec + "c").c_str(), arg && !arg->empty() ? (*arg)[0] : '\0');
+                    result += buffer;
+                    break;
+                case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                    arg = nextArg();
+                    snprintf(buffer, sizeof(buffer), (spec + conversion).c_str(), arg ? strtod(arg->c_str(), nullptr) : 0.0);
+                    result += buffer;
+                    break;
+                case 's': case 'b': {
+                    arg = nextArg();
+                    string text = arg ? *arg : "";
+                    bool stop = false;
+                    if (conversion == 'b') {
+                        string expanded;
+                        for (size_t k = 0; k < text.size() && !stop;) {
+                            if (text[k] != '\\') expanded += text[k++];
+                            else stop = !appendEscape(text, k, expanded, true);
+                        }
+                        text = move(expanded);
+                    }
+                    if (spec == "%") {
+                        result += text;
+                    } else {
+                        int needed = snprintf(nullptr, 0, (spec + "s").c_str(), text.c_str());
+                        string formatted(needed, '\0');
+                        snprintf(&formatted[0], needed + 1, (spec + "s").c_str(), text.c_str());
+                        result += formatted;
+                    }
+                    if (stop) {
+                        out.append(result);
+                        return status;
+                    }
+                    break;
+                }
+                default:
+                    cerr << "mish: printf: %" << conversion << ": invalid format character" << endl;
+                    out.append(result);
+                    return 1;
+            }
+        }
+        out.append(result);
+    } while (next < args.size() && next > 2);
+    return status;
+}
+
+/**
+ * pwd: writes the current working directory.
+ */
+int builtinPwd(const vector<string>&, BuiltinOutput& out) {
+    char cwd[PATH_MAX]; // On the stack, like the prompt's, so pwd allocates nothing.
+    if (!getcwd(cwd, sizeof(cwd))) {
+        cerr << "mish: pwd: " << strerror(errno) << endl;
+        return 1;
+    }
+    out.append(cwd);
+    out.append("\n");
+    return 0;
+}
+
+int builtinTrue(const vector<string>&, BuiltinOutput&) { return 0; }
+int builtinFalse(const vector<string>&, BuiltinOutput&) { return 1; }
+
+/**
+ * Returns a walk root as it should begin the paths below it.
+ */
+string walkPrefix(const string& root) {
+    return root.back() == '/' ? root : root + "/";
+}
+
+/**
+ * find: lists the trees below each path, or below ".", with the entries that pass the -name
+ * and -type tests. Unlike the real find the listing is sorted, parents before children and
+ * siblings bytewise, so it is the same on every run however the walk was shared out.
+ */
+int builtinFind(const vector<string>& args, BuiltinOutput& out) {
+    vector<string> roots;
+    size_t i = 1;
+    for (; i < args.size() && args[i][0] != '-'; ++i) roots.push_back(args[i]);
+    if (roots.empty()) roots.push_back(".");
+    vector<GlobPattern> names;
+    unsigned char type = DT_UNKNOWN; // Any type.
+    for (; i < args.size(); ++i) {
+        if (args[i] == "-name") {
+            names.push_back(compileGlob(args[++i]));
+            names.back().literalDot = true; // find's patterns match hidden names too.
+        } else if (args[i] == "-type") {
+            type = args[++i] == "d" ? DT_DIR : args[i] == "l" ? DT_LNK : DT_REG;
+        }
+    }
+    auto passes = [&](string_view name, unsigned char entryType) {
+        if (type != DT_UNKNOWN && entryType != type) return false;
+        return all_of(names.begin(), names.end(), [&](const GlobPattern& pattern) { return pattern.matches(name); });
+    };
+
+    int status = 0;
+    WalkOptions options;
+    options.keep = passes;
+    for (const string& root : roots) {
+        struct stat info;
+        if (lstat(root.c_str(), &info) == -1) {
+            cerr << "find: '" << root << "': " << strerror(errno) << endl;
+            status = 1;
+            continue;
+        }
+        size_t slash = root.find_last_not_of('/');
+        string_view base = slash == string::npos ? string_view("/") : string_view(root).substr(0, slash + 1);
+        if (base.find('/') != string_view::npos) base = base.substr(base.rfind('/') + 1);
+        if (passes(base, IFTODT(info.st_mode))) {
+            out.append(root);
+            out.append("\n");
+        }
+        if (!S_ISDIR(info.st_mode)) continue;
+        vector<WalkEntry> entries;
+        vector<string> errors;
+        walkTree(walkPrefix(root), options, entries, errors);
+        if (inProcessStageCancelled()) return 128 + inProcessStageCancelled(); // What it found is only part of the tree.
+        for (const string& error : errors) cerr << "find: " << error << endl;
+        if (!errors.empty()) status = 1;
+        for (const WalkEntry& entry : entries) {
+            out.append(entry.path);
+            out.append("\n");
+        }
+    }
+    return status;
+}
+
+/**
+ * du: reports the disk usage of each directory below each path, or of "." alone, in KiB,
+ * children before their parents. -s reports only the totals for the paths, and -a lists files
+ * too. Files with several hard links are counted once.
+ */
+int builtinDu(const vector<string>& args, BuiltinOutput& out) {
+    vector<string> roots;
+    bool summarize = false, all = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i][0] != '-') roots.push_back(args[i]);
+        else if (args[i].find('s') != string::npos) summarize = true;
+        if (args[i][0] == '-' && args[i].find('a') != string::npos) all = true;
+    }
+    if (roots.empty()) roots.push_back(".");
+    auto report = [&](uint64_t blocks, const string& path) {
+        out.append(to_string((blocks + 1) / 2) + "\t" + path + "\n");
+    };
+
+    int status = 0;
+    WalkOptions options;
+    options.sizes = true;
+    for (const string& root : roots) {
+        struct stat info;
+        if (lstat(root.c_str(), &info) == -1) {
+            cerr << "du: cannot access '" << root << "': " << strerror(errno) << endl;
+            status = 1;
+            continue;
+        }
+        if (!S_ISDIR(info.st_mode)) {
+            report(info.st_blocks, root);
+            continue;
+        }
+        vector<WalkEntry> entries;
+        vector<string> errors;
+        string prefix = walkPrefix(root);
+        walkTree(prefix, options, entries, errors, true);
+        if (inProcessStageCancelled()) return 128 + inProcessStageCancelled();
+        for (const string& error : errors) cerr << "du: cannot read directory " << error << endl;
+        if (!errors.empty()) status = 1;
+
+        // Add each entry to the directories above it; entries arrive with children first
+        unordered_map<string_view, uint64_t> totals;
+        set<pair<dev_t, ino_t>> counted;
+        uint64_t total = info.st_blocks;
+        for (const WalkEntry& entry : entries) {
+            if (entry.linked && !counted.insert({entry.device, entry.inode}).second) continue;
+            uint64_t blocks = entry.blocks;
+            if (entry.type == DT_DIR) blocks = totals[entry.path] += blocks;
+            if (!summarize && (entry.type == DT_DIR || all)) report(blocks, entry.path);
+            size_t slash = entry.path.rfind('/');
+            if (slash + 1 > prefix.size()) totals[string_view(entry.path).substr(0, slash)] += blocks;
+            else total += blocks;
+        }
+        report(total, root);
+    }
+    return status;
+}
+
+/**
+ * Evaluates test(1) expressions over a range of arguments. Up to four arguments follow the
+ * POSIX rules that decide by argument count; longer expressions are parsed with -o binding
+ * looser than -a, which binds looser than !.
+ */
+struct TestEvaluator {
+    const vector<string>& args;
+    size_t end;
+    string error;
+
+    bool isUnary(const string& op) {
+        return op.size() == 2 && op[0] == '-' && strchr("bcdefghknprsStuwxzGLO", op[1]);
+    }
+
+    bool isBinary(const string& op) {
+        static const char* ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge",
+                                    "-nt", "-ot", "-ef"};
+        return any_of(std::begin(ops), std::end(ops), [&](const char* candidate) { return op == candidate; });
+    }
+
+    long long integer(const string& text) {
+        char* tail;
+        errno = 0;
+        long long value = strtoll(text.c_str(), &tail, 10);
+        while (isspace((unsigned char) *tail)) tail++;
+        if (text.empty() || *tail != '\0' || errno != 0) {
+            if (error.empty()) error = text + ": integer expression expected";
+        }
+        return value;
+    }
+
+    bool unary(const string& op, const string& operand) {
+        struct stat info;
+        char flag = op[1];
+        if (flag == 'z') return operand.empty();
+        if (flag == 'n') return !operand.empty();
+        if (flag == 't') return isatty((int) integer(operand));
+        if (flag == 'h' || flag == 'L') return lstat(operand.c_str(), &info) == 0 && S_ISLNK(info.st_mode);
+        if (flag == 'r') return access(operand.c_str(), R_OK) == 0;
+        if (flag == 'w') return access(operand.c_str(), W_OK) == 0;
+        if (flag == 'x') return access(operand.c_str(), X_OK) == 0;
+        if (stat(operand.c_str(), &info) != 0) return false;
+        switch (flag) {
+            case 'e': return true;
+            case 'f': return S_ISREG(info.st_mode);
+            case 'd': return S_ISDIR(info.st_mode);
+            case 'b': return S_ISBLK(info.st_mode);
+            case 'c': return S_ISCHR(info.st_mode);
+            case 'p': return S_ISFIFO(info.st_mode);
+            case 'S': return S_ISSOCK(info.st_mode);
+            case 's': return info.st_size > 0;
+            case 'g': return info.st_mode & S_ISGID;
+            case 'u': return info.st_mode & S_ISUID;
+            case 'k': return info.st_mode & S_ISVTX;
+            case 'G': return info.st_gid == getegid();
+            case 'O': return info.st_uid == geteuid();
+        }
+        return false;
+    }
+
+    bool binary(const string& left, const string& op, const string& right) {
+        if (op == "=" || op == "==") return left == right;
+        if (op == "!=") return left != right;
+        if (op == "<") return left < right;
+        if (op == ">") return left > right;
+        if (op == "-nt" || op == "-ot" || op == "-ef") {
+            struct stat a, b;
+            bool haveA = stat(left.c_str(), &a) == 0, haveB = stat(right.c_str(), &b) == 0;
+            auto newer = [](const struct stat& x, const struct stat& y) {
+                return x.st_mtim.tv_sec != y.st_mtim.tv_sec ? x.st_mtim.tv_sec > y.st_mtim.tv_sec
+                                                            : x.st_mtim.tv_nsec > y.st_mtim.tv_nsec;
+            };
+            if (op == "-nt") return haveA && (!haveB || newer(a, b));
+            if (op == "-ot") return haveB && (!haveA || newer(b, a));
+            return haveA && haveB && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        }
+        long long l = integer(left), r = integer(right);
+        if (op == "-eq") return l == r;
+        if (op == "-ne") return l != r;
+        if (op == "-lt") return l < r;
+        if (op == "-le") return l <= r;
+        if (op == "-gt") return l > r;
+        return l >= r;
+    }
+
+    /**
+     * Applies the POSIX rules for expressions of at most four arguments.
+     */
+    bool byCount(size_t first, size_t count) {
+        const string* a = &args[first];
+        switch (count) {
+            case 0: return false;
+            case 1: return !a[0].empty();
+            case 2:
+                if (a[0] == "!") return a[1].empty();
+                if (isUnary(a[0])) return unary(a[0], a[1]);
+                break;
+            case 3:
+                if (isBinary(a[1])) return binary(a[0], a[1], a[2]);
+                if (a[1] == "-a") return !a[0].empty() && !a[2].empty();
+                if (a[1] == "-o") return !a[0].empty() || !a[2].empty();
+                if (a[0] == "!") return !byCount(first + 1, 2);
+                if (a[0] == "(" && a[2] == ")") return byCount(first + 1, 1);
+                break;
+            case 4:
+                if (a[0] == "!") return !byCount(first + 1, 3);
+                if (a[0] == "(" && a[3] == ")") return byCount(first + 1, 2);
+                break;
+        }
+        size_t position = first;
+        bool result = orExpression(position);
+        if (position != first + count && error.empty()) error = args[position] + ": unexpected argument";
+        return result;
+    }
+
+    bool orExpression(size_t& i) {
+        bool result = andExpression(i);
+        while (i < end && args[i] == "-o") {
+            i++;
+            result = andExpression(i) || result;
+        }
+        return result;
+    }
+
+    bool andExpression(size_t& i) {
+        bool result = notExpression(i);
+        while (i < end && args[i] == "-a") {
+            i++;
+            result = notExpression(i) && result;
+        }
+        return result;
+    }
+
+    bool notExpression(size_t& i) {
+        if (i < end && args[i] == "!") {
+            i++;
+            return !notExpression(i);
+        }
+        return primary(i);
+    }
+
+    bool primary(size_t& i) {
+        if (i >= end) {
+            if (error.empty()) error = "argument expected";
+            return false;
+        }
+        if (args[i] == "(") {
+            i++;
+            bool result = orExpression(i);
+            if (i >= end || args[i] != ")") {
+                if (error.empty()) error = "')' expected";
+            } else {
+                i++;
+            }
+            return result;
+        }
+        if (isUnary(args[i]) && i + 1 < end) {
+            i += 2;
+            return unary(args[i - 2], args[i - 1]);
+        }
+        if (i + 2 < end && isBinary(args[i + 1])) {
+            i += 3;
+            return binary(args[i - 3], args[i - 2], args[i - 1]);
+        }
+        return !args[i++].empty();
+    }
+};
+
+/**
+ * test expr, or [ expr ]: evaluates a conditional expression.
+ * @return 0 if it is true, 1 if false, 2 on a syntax error.
+ */
+int builtinTest(const vector<string>& args, BuiltinOutput&) {
+    size_t end = args.size();
+    if (args[0] == "[") {
+        if (args.back() != "]") {
+            cerr << "mish: [: missing `]'" << endl;
+            return 2;
+        }
+        end--;
+    }
+    TestEvaluator evaluator{args, end, {}};
+    bool result = evaluator.byCount(1, end - 1);
+    if (!evaluator.error.empty()) {
+        cerr << "mish: " << args[0] << ": " << evaluator.error << endl;
+        return 2;
+    }
+    return result ? 0 : 1;
+}
+
+using BuiltinFunction = int (*)(const vector<string>& args, BuiltinOutput& out);
+
+/**
+ * Utilities the shell runs itself instead of starting a process. They only write output, so
+ * they also work inside pipelines and with redirection.
+ */
+const unordered_map<string, BuiltinFunction> simpleBuiltins = {
+        {"echo", builtinEcho}, {"printf", builtinPrintf}, {"pwd", builtinPwd}, {"test", builtinTest},
+        {"[", builtinTest}, {"true", builtinTrue}, {"false", builtinFalse},
+};
+
+bool treeWalker = false; // "set -o treewalk": run find and du on the shell's walker, whose output is sorted unlike the real programs'.
+
+/**
+ * Decides whether find or du can be run by the shell: "set -o treewalk" must be on, and only
+ * the options the builtins implement may be used, otherwise the real program runs.
+ * @return The builtin, or nullptr.
+ */
+BuiltinFunction treeWalkerFor(const vector<string>& args) {
+    if (!treeWalker) return nullptr;
+    if (args[0] == "find") {
+        size_t i = 1;
+        while (i < args.size() && !args[i].empty() && args[i][0] != '-') i++;
+        for (; i < args.size(); ++i) {
+            if (args[i] == "-print") continue;
+            if (i + 1 == args.size()) return nullptr;
+            if (args[i] == "-name") i++;
+            else if (args[i] == "-type" && (args[i + 1] == "f" || args[i + 1] == "d" || args[i + 1] == "l")) i++;
+            else return nullptr;
+        }
+        return builtinFind;
+    }
+    if (args[0] == "du") {
+        bool pathsStarted = false;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i].empty()) return nullptr;
+            if (args[i][0] != '-') pathsStarted = true;
+            else if (pathsStarted || args[i].size() < 2 || args[i].find_first_not_of("sak", 1) != string::npos) return nullptr;
+        }
+        return builtinDu;
+    }
+    return nullptr;
+}
+
+/**
+ * Runs a simple builtin with its output going to fd.
+ * @return The builtin's status, 141 if its reader went away as with SIGPIPE, or 1 on another write error.
+ */
+int runBuiltin(BuiltinFunction builtin, const vector<string>& args, int fd) {
+    BuiltinOutput out(fd);
+    int status = builtin(args, out);
+    if (!out.flush()) {
+        if (out.error == EPIPE) return 128 + SIGPIPE;
+        cerr << "mish: " << args[0] << ": write error: " << strerror(out.error) << endl;
+        return 1;
+    }
+    return status;
+}
+
+/**
+ * Runs a simple builtin given as a complete command with its own redirections, which are
+ * followed to find where its output goes. Every file is still opened, so errors are reported,
+ * though none of these builtins read their input.
+ * @param command The expanded command.
+ * @param builtin The builtin it names.
+ * @return The exit status.
+ */
+int executeBuiltin(const SimpleCommand& command, BuiltinFunction builtin) {
+    FdActions actions;
+    ArenaVector<int> opened;
+    if (!redirectionActions(command.redirections, actions, opened)) return 1;
+    int in = STDIN_FILENO, out = STDOUT_FILENO;
+    followActions(actions, in, out); // So "echo error >&2" writes to the shell's standard error.
+    cout << flush; // Keep anything the shell printed ahead of the builtin's output.
+    int status = runBuiltin(builtin, command.args, out);
+    for (int fd : opened) close(fd);
+    return status;
+}
+
+/**
+ * Work a pipeline stage can do inside the shell. It reads from in, or -1 when it has no input,
+ * writes to out, and returns the stage's exit status.
+ */
+using StageBody = function<int(int in, int out)>;
+
+/**
+ * Decides whether a pipeline stage can run in the shell: a plain cat with something to read,
+ * one of the simple builtins, or find or du.
+ * @param args The stage's command and arguments, without redirections.
+ * @param hasInput Whether the stage reads from a pipe or a redirected file rather than the terminal.
+ * @return The work to run on a helper thread, or an empty function to launch a process.
+ */
+StageBody inProcessStageFor(const vector<string>& args, bool hasInput) {
+    if (args.empty()) return nullptr;
+    if (isPlainCat(args) && (args.size() > 1 || hasInput)) {
+        vector<string> files(args.begin() + 1, args.end());
+        return [files](int in, int out) { return catFiles(files, in, out); };
+    }
+    auto builtin = simpleBuiltins.find(args[0]);
+    BuiltinFunction function = builtin != simpleBuiltins.end() ? builtin->second : treeWalkerFor(args);
+    if (function) {
+        return [function, args](int, int out) { return runBuiltin(function, args, out); };
+    }
+    return nullptr;
+}
+
+int argumentBatches = 0; // "set -o argbatch[=n]": run commands with too many arguments in batches, n at a time; 0 is off.
+
+/**
+ * Returns the room execve leaves for a command's arguments: ARG_MAX less the environment's
+ * share, and 2 KiB of headroom as xargs keeps.
+ */
+size_t argumentSpace(char* const* envp) {
+    long limit = sysconf(_SC_ARG_MAX);
+    size_t space = limit > 0 ? limit : 128 * 1024;
+    for (char* const* entry = envp; *entry; ++entry) space -= min(space, strlen(*entry) + 1 + sizeof(char*));
+    return space > 2048 ? space - 2048 : 0;
+}
+
+/**
+ * Returns what an argument costs against ARG_MAX: the string, its null and its pointer.
+ */
+size_t argumentSize(const string& arg) {
+    return arg.size() + 1 + sizeof(char*);
+}
+
+/**
+ * Tells whether argument batching is on and a command's arguments are too long to exec at once.
+ */
+bool needsArgumentBatches(const SimpleCommand& command, char* const* envp) {
+    if (argumentBatches == 0) return false;
+    size_t size = 0;
+    for (const string& arg : command.args) size += argumentSize(arg);
+    return size > argumentSpace(envp);
+}
+
+void runArgumentBatches(const SimpleCommand& command, bool background, char* const* envp);
+
+/**
+ * Executes a command by resolving it through the hash table and launching it as a job.
+ * @param command The expanded command with its redirections.
+ * @param background Whether to return to the prompt without waiting.
+ */
+void executeCommand(const SimpleCommand& command, bool background) {
+    char* const* envp = environmentWith(command.assignments);
+    if (needsArgumentBatches(command, envp)) {
+        runArgumentBatches(command, background, envp);
+        return;
+    }
+
+    ArenaVector<char*> args;
+    args.reserve(command.args.size() + 1);
+    for (const string& arg : command.args) args.push_back(const_cast<char*>(arg.c_str()));
+    args.push_back(nullptr);  // execvp expects a null-terminated array
+
+    // Redirections are opened here and become descriptor actions performed by the child before exec
+    FdActions actions;
+    ArenaVector<int> opened;
+    if (!redirectionActions(command.redirections, actions, opened)) {
+        lastExitStatus = 1;
+        pipeStatus = {lastExitStatus};
+        return;
+    }
+
+    SpawnOptions options;
+    options.foreground = !background;
+    options.environment = envp;
+    options.path = assignedPath(command.assignments);
+    int error;
+    pid_t pid = launchCommand(args.data(), actions, options, error);
+    for (int fd : opened) close(fd);
+    if (pid == -1) {
+        lastExitStatus = reportSpawnError(args[0], error);
+        pipeStatus = {lastExitStatus};
+        return;
+    }
+
+    Job job;
+    job.pgid = pid;
+    job.processes.push_back({pid});
+    job.command = string(command.text);
+    startJob(move(job), background);
+}
+
+/**
+ * Closes the descriptors a forked subshell inherited from the shell: pipes and redirections
+ * meant for other commands, the event loop's descriptors, and so on. They are all
+ * close-on-exec, but a subshell never execs, and a pipe left open here would keep its reader
+ * from ever seeing end of file.
+ */
+void closeShellDescriptors() {
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir) return;
+    vector<int> fds;
+    while (dirent* entry = readdir(dir)) {
+        int fd = atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(dir) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)) fds.push_back(fd);
+    }
+    closedir(dir);
+    sort(fds.begin(), fds.end());
+    for (size_t i = 0; i < fds.size();) { // A pipeline's pipes are mostly numbered in runs; close_range takes each run at once.
+        size_t end = i + 1;
+        while (end < fds.size() && fds[end] == fds[end - 1] + 1) end++;
+        if (syscall(SYS_close_range, fds[i], fds[end - 1], 0) != 0) {
+            for (size_t k = i; k < end; ++k) close(fds[k]);
+        }
+        i = end;
+    }
+}
+
+/**
+ * Turns a freshly forked child into a subshell with an event loop and job table of its own.
+ * Job control stays with the parent: the subshell's commands join its process group, and
+ * it neither hands out the terminal nor reports stopped jobs.
+ */
+void becomeSubshell() {
+    closeShellDescriptors();
+    epollFd = -1;
+    watchHandlers.clear();
+    watchIdByFd.clear();
+    // The parent's jobs are not ours to wait for; their descriptors are already closed. Their in-process
+    // stages' threads did not survive the fork, and a thread object still marked joinable can't be
+    // destroyed, so only those stages are left allocated.
+    for (auto& entry : jobTable) {
+        for (JobProcess& process : entry.second.processes) {
+            if (process.inProcess) new shared_ptr<InProcessStage>(move(process.inProcess));
+        }
+    }
+    jobTable.clear();
+    jobByPid.clear();
+    finishedJobs.clear();
+    highestJobId = 0;
+    jobControl = false;
+    interactiveShell = false;
+    initJobControl(false);
+    terminalFd = -1;
+}
+
+/**
+ * Forks a subshell that runs part of the command line, such as "( ... )" or a "{ ... }" group
+ * within a pipeline. It never execs: the forked copy of the shell runs the body itself.
+ * @param body Runs in the child and returns its exit status.
+ * @param actions The child's pipe plumbing and redirections, with every file already open.
+ * @param options The process group and terminal settings for the child.
+ * @param error Receives the errno of a failed fork.
+ * @return The child's pid, or -1 on failure.
+ */
+pid_t forkSubshell(const function<int()>& body, const FdActions& actions, const SpawnOptions& options, int& error) {
+    cout << flush; // Otherwise the child would print whatever is still buffered again.
+    pid_t pid = fork();
+    if (pid == -1) {
+        error = errno;
+        return -1;
+    }
+    if (pid == 0) {
+        prepareChild(options);
+        if (applyFdActions(actions) != 0) _exit(1);
+        becomeSubshell();
+        int status = body();
+        cout << flush;
+        _exit(status);
+    }
+    placeInProcessGroup(pid, options);
+    return pid;
+}
+
+/**
+ * One stage of a pipeline, prepared before anything is launched.
+ */
+struct PipelineStage {
+    vector<string> args;
+    vector<string> assignments; // Prefix assignments for the stage's environment.
+    vector<Redirection> redirections;
+    function<int()> subshell; // Set when the stage runs in a forked subshell.
+    string name;              // The command name, or the text of a subshell.
+    int input = -1;         // Descriptor to use as standard input, or -1 for the shell's own.
+    int output = -1;        // Descriptor to use as standard output, or -1 for the shell's own.
+    StageBody body;         // Set when the stage runs in the shell.
+    shared_ptr<InProcessStage> inProcess;
+    string path;            // The resolved executable otherwise.
+    char** argv = nullptr;  // Argument vector in commandArena, built before launching.
+    FdActions actions;      // Plumbing for standard input and output, then the redirections.
+    ArenaVector<int> opened; // Files the redirections opened in the shell, closed once it is launched.
+    char* const* environment = nullptr; // Its envp, likewise, when it has prefix assignments.
+    pid_t pid = 0;
+    int error = 0;          // errno of a failed launch.
+    bool failed = false;    // Set when the stage cannot run at all, such as a missing input file.
+    int status = 1;         // The exit status reported for it then.
+};
+
+/**
+ * Connects a stage to its pipes and opens its redirections, which come after the pipes, so
+ * "2>&1" sends errors down the pipe and ">out" replaces it. The neighbouring stage then sees
+ * end of file or a broken pipe as it would in sh, once the shell closes its own ends.
+ */
+void openStageRedirections(PipelineStage& stage) {
+    if (stage.input != -1) stage.actions.push_back(dupAction(stage.input, STDIN_FILENO));
+    if (stage.output != -1) stage.actions.push_back(dupAction(stage.output, STDOUT_FILENO));
+    if (!redirectionActions(stage.redirections, stage.actions, stage.opened)) stage.failed = true;
+}
+
+/**
+ * Builds a stage's argument vector and file actions in commandArena. This happens on the
+ * main thread, since the arena is not shared with the launcher threads.
+ */
+void prepareStageLaunch(PipelineStage& stage) {
+    stage.argv = segment_args(stage.args);
+    if (!stage.assignments.empty()) stage.environment = environmentWith(stage.assignments);
+}
+
+/**
+ * Spawns one prepared pipeline stage. Safe to call from several threads at once, since it
+ * neither touches the hash table, the arena nor any other shell state.
+ */
+void launchStage(PipelineStage& stage, const SpawnOptions& options) {
+    if (stage.environment) {
+        SpawnOptions stageOptions = options;
+        stageOptions.environment = stage.environment;
+        stage.pid = spawnResolved(stage.path, stage.argv, stage.actions, stageOptions, stage.error);
+        return;
+    }
+    stage.pid = spawnResolved(stage.path, stage.argv, stage.actions, options, stage.error);
+}
+
+int pipelineLaunchers = 1; // "set -o launchers[=n]": threads that launch a pipeline's stages at once; 1 launches them in turn.
+
+/**
+ * Returns how many threads launch pipeline stages at once. Launching in parallel only pays off
+ * with spare cores to overlap the exec waits on, so it is off unless "set -o launchers" asks for it.
+ */
+size_t launcherThreads() {
+    return max(1, pipelineLaunchers);
+}
+
+/**
+ * Launches the given stages, spread over launcherThreads() threads.
+ * Every spawn waits until its child has exec'd, so launching in parallel overlaps those waits.
+ * @param stages The pipeline's stages.
+ * @param indices Which stages to launch.
+ * @param options The shared process group and terminal settings.
+ */
+void launchStagesConcurrently(ArenaVector<PipelineStage>& stages, const vector<size_t>& indices,
+                              const SpawnOptions& options) {
+    atomic<size_t> next{0};
+    auto launchRemaining = [&]() {
+        for (size_t k; (k = next++) < indices.size();) launchStage(stages[indices[k]], options);
+    };
+    size_t helpers = min(indices.size(), launcherThreads());
+    vector<thread> threads;
+    for (size_t h = 1; h < helpers; ++h) threads.emplace_back(launchRemaining);
+    launchRemaining();
+    for (thread& helper : threads) helper.join();
+}
+
+/**
+ * Wraps the work of an in-process stage to run in a forked subshell instead, on its standard
+ * input and output.
+ * @param reads Whether the stage has input to read, rather than none.
+ * @param writes Whether its output is open.
+ */
+function<int()> forkedStageBody(StageBody body, bool reads, bool writes) {
+    return [body, reads, writes]() { return body(reads ? STDIN_FILENO : -1, writes ? STDOUT_FILENO : -1); };
+}
+
+/**
+ * Returns how many descriptors one pipeline's in-process stages may hold while they run: a
+ * quarter of RLIMIT_NOFILE, leaving the rest for the shell, redirections and the pipes being built.
+ */
+size_t inProcessFdBudget() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) return 1024;
+    return limit.rlim_cur / 4;
 }
+
 /**
- * Finds the index of a specific token within a vector of strings.
- * @param tokens The vector of strings.
- * @param token The string to find.
- * @return The index of the token, or -1 if not found.
+ * Returns how many stages of a pipeline to connect and launch at once: launcherThreads(), but
+ * narrowed so the window's pipes and redirections fit in the descriptors RLIMIT_NOFILE leaves
+ * free, counting four per stage. Those already open are counted through /proc/self/fd.
  */
-int findTokenIndex(const vector<string>& tokens, const string& token) {
-    auto it = find(tokens.begin(), tokens.end(), token);
-    return it != tokens.end() ? distance(tokens.begin(), it) : -1;
+size_t pipelineWindow() {
+    size_t threads = launcherThreads();
+    struct rlimit limit;
+    if (threads == 1 || getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) return threads;
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir) return 1;
+    size_t open = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') open++; // Includes the directory's own descriptor, as a margin.
+    }
+    closedir(dir);
+    size_t spare = limit.rlim_cur > open ? limit.rlim_cur - open : 0;
+    return max<size_t>(1, min(threads, spare / 4));
 }
 
 /**
- * Checks if a series of tokens has any syntax errors related to redirection or piping.
- * @param tokens The command tokens.
- * @return true if there are syntax errors, false otherwise.
+ * Executes a series of piped commands as one job sharing a process group. The stages are set
+ * up and launched a window of pipelineWindow() at a time: the window's pipes and redirections
+ * are opened close-on-exec and its commands resolved, then it is launched, subshells and the
+ * group leader first and the rest concurrently, and the shell closes its ends of the pipes.
+ * Only the read end of the last pipe is carried into the next window. With one launcher thread,
+ * the default, the shell holds at most three pipe descriptors: the pipe it is connecting plus
+ * that end. A wider window holds two per stage, so it is narrowed when few descriptors are free.
+ * @param stages The stages, with their expanded arguments and redirections or subshell bodies.
+ * @param text The pipeline as written, shown by "jobs".
+ * @param background Whether to return to the prompt without waiting.
+ * @param pipeline Settings for this pipeline only, such as its pipe capacity.
  */
-bool hasSyntaxErrors(const vector<string>& tokens) {
-    int redirectInCount = 0, redirectOutCount = 0, pipeCount = 0;
-    string prevToken = "";
+void executePipedCommand(ArenaVector<PipelineStage>& stages, string_view text, bool background,
+                         const PipelineOptions& pipeline) {
+    Job job;                          // Collects the launched stages
+    job.command = string(text);
+    job.collectStats = pipeStats;
+    job.timed = pipeline.timed;
+    job.timeJson = pipeline.timeJson;
+    job.launched = chrono::steady_clock::now();
 
-    for (size_t i = 0; i < tokens.size(); ++i) {
-        if (tokens[i] == "<") {
-            redirectInCount++;
-            if (i == 0 || tokens[i - 1] == "|" || redirectInCount > 1) {
-                cerr << "mish: multiple input redirect or pipe" << endl;
-                return true;
+    SpawnOptions options;
+    options.foreground = !background;
+    options.environment = exportedEnvironment(); // Built here, since the launcher threads must not.
+    size_t window = pipelineWindow();
+    size_t inProcessBudget = inProcessFdBudget(), inProcessFds = 0;
+    int carried = -1;        // Read end of the last pipe, for the next stage.
+    bool pipesFailed = false;
+
+    for (size_t first = 0; first < stages.size(); first += window) {
+        size_t last = min(stages.size(), first + window);
+
+        // Connect the window's stages, open their redirections and decide how each runs
+        for (size_t i = first; i < last; ++i) {
+            PipelineStage& stage = stages[i];
+            stage.input = carried;
+            carried = -1;
+            if (i + 1 < stages.size() && !pipesFailed) {
+                int fd[2];
+                if (pipe2(fd, O_CLOEXEC) == -1) {
+                    cerr << "mish: pipe: " << strerror(errno) << endl;
+                    pipesFailed = true;
+                } else {
+                    PipeInfo pipeInfo;
+                    struct stat info;
+                    if (fstat(fd[0], &info) == 0) pipeInfo.inode = info.st_ino;
+                    pipeInfo.initialSize = pipeInfo.size = applyPipeSize(fd[1], pipeline.pipeSize ? pipeline.pipeSize : pipeSize);
+                    job.pipes.push_back(pipeInfo);
+                    stage.output = fd[1];
+                    carried = fd[0];
+                }
             }
-        } else if (tokens[i] == ">") {
-            redirectOutCount++;
-            if (i == 0 || tokens[i - 1] == "|" || redirectOutCount > 1) {
-                cerr << "mish: multiple output redirect or pipe" << endl;
-                return true;
+            if (pipesFailed && !stage.failed) {
+                stage.failed = true; // This stage and the rest can't be connected; the ones before see a broken pipe.
+                stage.status = 1;
             }
-        } else if (tokens[i] == "|") {
-            pipeCount++;
-            if (prevToken == "|" || i == 0 || i == tokens.size() - 1) {
-                cerr << "mish: syntax error, unexpected PIPE, expecting STRING" << endl;
-                return true;
+            if (!stage.failed) openStageRedirections(stage);
+            if (stage.args.empty() && !stage.subshell && !stage.failed) {
+                stage.failed = true; // Only redirections, which have now been made.
+                stage.status = 0;
+            }
+            int in = -1, out = STDOUT_FILENO;
+            followActions(stage.actions, in, out);
+            if (i < job.pipes.size()) job.pipes[i].connected = out == stage.output; // Not so with "cmd >file | ...".
+            if (stage.failed || stage.subshell) continue;
+            stage.body = inProcessStageFor(stage.args, in != -1);
+            if (stage.body && inProcessFds + 3 > inProcessBudget) {
+                // Its pipe copies and eventfd would stay open in the shell as long as it runs; fork it instead.
+                stage.subshell = forkedStageBody(stage.body, in != -1, out != -1);
+                stage.body = nullptr;
+                continue;
             }
+            if (stage.body) inProcessFds += 3;
+            if (!stage.body && !resolveCommand(stage.args[0], stage.path, assignedPath(stage.assignments))) stage.error = ENOENT;
+            if (!stage.body) prepareStageLaunch(stage);
         }
-        prevToken = tokens[i];
-    }
 
-    return false;
+        // Start the in-process stages, subshells and the group leader, collecting the rest to launch together
+        vector<size_t> concurrent;
+        for (size_t i = first; i < last; ++i) {
+            PipelineStage& stage = stages[i];
+            if (stage.failed || stage.error != 0) continue;
+            if (stage.body) {
+                int in = -1, out = STDOUT_FILENO;
+                followActions(stage.actions, in, out);
+                int inCopy = in == -1 ? -1 : fcntl(in, F_DUPFD_CLOEXEC, firstShellFd); // Copies owned by the helper thread
+                int outCopy = out == -1 ? -1 : fcntl(out, F_DUPFD_CLOEXEC, firstShellFd);
+                if ((in == -1 || inCopy != -1) && (out == -1 || outCopy != -1)) {
+                    stage.inProcess = startInProcessStage([body = stage.body, inCopy, outCopy]() {
+                        int status = body(inCopy, outCopy);
+                        if (inCopy != -1) close(inCopy);
+                        if (outCopy != -1) close(outCopy);
+                        return status;
+                    });
+                    continue;
+                }
+                if (inCopy != -1) close(inCopy); // Out of descriptors; a forked stage needs none in the shell.
+                if (outCopy != -1) close(outCopy);
+                stage.subshell = forkedStageBody(stage.body, in != -1, out != -1);
+                stage.body = nullptr;
+            }
+            if (stage.subshell) {
+                stage.pid = forkSubshell(stage.subshell, stage.actions, options, stage.error);
+                if (options.pgid == 0 && stage.pid > 0) options.pgid = stage.pid;
+            } else if (options.pgid == 0) {
+                launchStage(stage, options);
+                if (stage.pid > 0) options.pgid = stage.pid; // The first launched stage leads the group
+            } else {
+                concurrent.push_back(i);
+            }
+        }
+        launchStagesConcurrently(stages, concurrent, options);
+
+        // Release the window's descriptors; only the carried read end stays open
+        for (size_t i = first; i < last; ++i) {
+            PipelineStage& stage = stages[i];
+            if (stage.pid == -1 && stage.error == ENOENT && !stage.subshell && !assignedPath(stage.assignments) &&
+                commandHash.count(stage.args[0])) {
+                commandHash.erase(stage.args[0]); // The cached binary is gone; look it up afresh.
+                if (resolveCommand(stage.args[0], stage.path)) launchStage(stage, options);
+                if (options.pgid == 0 && stage.pid > 0) options.pgid = stage.pid;
+            }
+            if (stage.input != -1) close(stage.input);
+            if (stage.output != -1) close(stage.output);
+            for (int fd : stage.opened) close(fd);
+
+            JobProcess process{stage.pid > 0 ? stage.pid : 0};
+            process.name = stage.name;
+            process.inProcess = stage.inProcess;
+            if (!stage.inProcess && stage.pid <= 0) {
+                process.exited = true; // Keep a slot so PIPESTATUS still lines up with the stages
+                process.status = (stage.failed ? stage.status : reportSpawnError(stage.name.c_str(), stage.error)) << 8;
+            }
+            job.processes.push_back(process);
+        }
+    }
+    job.pgid = options.pgid;
+    startJob(move(job), background);
 }
 
 /**
- * Executes a command by forking and using execvp.
- * @param tokens The command and its arguments.
+ * Runs a command whose arguments exceed ARG_MAX as several commands, the way xargs would. The
+ * args of the word that expanded to the most are shared out, and those before and after it
+ * are repeated in every batch, so "cp *.log dir/" copies into dir/ each time. Up to
+ * argumentBatches batches run at once as one job; redirections are opened once and shared.
+ * $? is the highest status of any batch and PIPESTATUS holds each batch's status.
+ * @param envp The command's environment, whose size counts against the limit too.
  */
-void executeCommand(const vector<string>& tokens) {
-    int redirectInIndex = findTokenIndex(tokens, "<");
-    int redirectOutIndex = findTokenIndex(tokens, ">");
-    int saved_stdout = -1;
-    int saved_stdin = -1;
-
-    vector<char*> args;
+void runArgumentBatches(const SimpleCommand& command, bool background, char* const* envp) {
+    const vector<string>& args = command.args;
+    if (background) { // The batches are run one wave after another by a subshell.
+        ArenaVector<PipelineStage> stages(1);
+        stages[0].name = args[0];
+        stages[0].subshell = [command]() {
+            executeCommand(command, false);
+            return lastExitStatus;
+        };
+        executePipedCommand(stages, command.text, true, PipelineOptions());
+        return;
+    }
 
-    // Prepare the arguments for execvp, excluding redirection tokens and file names
-    for (int i = 0; i < tokens.size(); ++i) {
-        if (i != redirectInIndex && i != redirectOutIndex &&
-            (redirectInIndex == -1 || i != redirectInIndex + 1) &&
-            (redirectOutIndex == -1 || i != redirectOutIndex + 1)) {
-            args.push_back(const_cast<char*>(tokens[i].c_str()));
+    // Share out the spread args among batches that fit alongside the fixed ones
+    size_t space = argumentSpace(envp);
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (i < command.spreadBegin || i >= command.spreadEnd) space -= min(space, argumentSize(args[i]));
+    }
+    vector<pair<size_t, size_t>> batches;
+    for (size_t i = command.spreadBegin; i < command.spreadEnd;) {
+        size_t end = i, used = 0;
+        while (end < command.spreadEnd && used + argumentSize(args[end]) <= space) used += argumentSize(args[end++]);
+        if (end == i) {
+            lastExitStatus = reportSpawnError(args[0].c_str(), E2BIG);
+            pipeStatus = {lastExitStatus};
+            return;
         }
+        batches.push_back({i, end});
+        i = end;
     }
-    args.push_back(nullptr);  // execvp expects a null-terminated array
 
-    pid_t pid = fork();
-    if (pid == -1) {
-        cerr << "Failed to fork process" << endl;
-        exit(EXIT_FAILURE);
-    } else if (pid == 0) { // Child process
-        // Handle input redirection
-        if (redirectInIndex != -1 && redirectInIndex + 1 < tokens.size()) {
-            int fd = open(tokens[redirectInIndex + 1].c_str(), O_RDONLY);
-            if (fd == -1) {
-                cerr << "Failed to open input redirection file" << endl;
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDIN_FILENO);
-            close(fd);
-        }
-        // Handle output redirection
-        if (redirectOutIndex != -1 && redirectOutIndex + 1 < tokens.size()) {
-            int fd = open(tokens[redirectOutIndex + 1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd == -1) {
-                perror("Failed to open output redirection file");
-                exit(EXIT_FAILURE);
+    FdActions actions;
+    ArenaVector<int> redirected;
+    if (!redirectionActions(command.redirections, actions, redirected)) {
+        lastExitStatus = 1;
+        pipeStatus = {lastExitStatus};
+        return;
+    }
+
+    vector<int> statuses;
+    for (size_t wave = 0; wave < batches.size() && !lineInterrupted; wave += argumentBatches) {
+        Job job;
+        job.command = string(command.text);
+        SpawnOptions options;
+        options.foreground = true;
+        options.environment = envp;
+        options.path = assignedPath(command.assignments);
+        for (size_t b = wave; b < min(batches.size(), wave + argumentBatches); ++b) {
+            ArenaVector<char*> argv;
+            for (size_t i = 0; i < args.size(); ++i) {
+                bool spread = i >= command.spreadBegin && i < command.spreadEnd;
+                if (!spread || (i >= batches[b].first && i < batches[b].second)) argv.push_back(const_cast<char*>(args[i].c_str()));
             }
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
+            argv.push_back(nullptr);
+            options.pgid = job.pgid;
+            int error;
+            pid_t pid = launchCommand(argv.data(), actions, options, error);
+            if (pid == -1) {
+                statuses.push_back(reportSpawnError(argv[0], error));
+                continue;
+            }
+            if (job.pgid == 0) job.pgid = pid;
+            job.processes.push_back({pid});
         }
-        // Execute the command
-        execvp(args[0], args.data());
+        if (job.pgid == 0) continue;
+        startJob(move(job), false);
+        statuses.insert(statuses.end(), pipeStatus.begin(), pipeStatus.end());
+        if (lastExitStatus == 128 + SIGTSTP) break; // Stopped; the rest of the batches are dropped.
+    }
+    for (int fd : redirected) close(fd);
+    lastExitStatus = statuses.empty() ? 0 : *max_element(statuses.begin(), statuses.end());
+    pipeStatus = statuses;
+}
 
+/**
+ * Retrieves the current working directory as a string.
+ * @return The current working directory.
+ */
+string getCurrentDirectory() {
+    char* cwd = getcwd(nullptr, 0); // Calls getcwd with nullptr and 0, which allocates a buffer of sufficient size automatically.
+    string currentDirStr(cwd); // Constructs a C++ string from the C-style string returned by getcwd.
+    free(cwd); // Frees the memory allocated by getcwd since it's no longer needed.
+    return currentDirStr; // Returns the current working directory as a C++ string.
+}
 
-        // If execvp returns, it's an error
-        if (errno == ENOENT) {
-            cerr << "mish: '" << args[0] << "': No such file or directory" << endl;
-        }
-//        else {
-//            cerr << "mish: Error executing '" << args[0] << "': " << strerror(errno) << endl;
-//        }
-        exit(EXIT_FAILURE);
+/**
+ * Handles variable assignment within the shell. The variable is passed to launched commands
+ * only if it is exported.
+ * @param input The full input string containing the assignment.
+ */
+void handleVariableAssignment(const string& input) {
+    size_t equalPos = input.find('='); // Finds the position of the '=' character.
+    if (equalPos != string::npos) { // Checks if '=' was found.
+        string_view varName = string_view(input).substr(0, equalPos); // Extracts the variable name from the input.
+        string_view value = string_view(input).substr(equalPos + 1); // Extracts the variable value.
 
-    } else { // Parent process
-        if (redirectOutIndex != -1) {
-            // Save stdout if it's being redirected
-            saved_stdout = dup(STDOUT_FILENO);
+        if (varName == "PATH") {
+            commandHash.clear(); // Remembered locations may no longer be reachable through the new PATH.
         }
-        if (redirectInIndex != -1) {
-            // Save stdin if it's being redirected
-            saved_stdin = dup(STDIN_FILENO);
+        if (varName == "PATH" && value.empty()) { // Special case for PATH variable being set to empty.
+            unsetVariable("PATH"); // Unsets the PATH variable.
+        } else {
+            setVariable(varName, value); // Sets or updates the variable, keeping its export flag.
         }
+    } else {
+        cerr << "Invalid assignment format." << endl; // Prints an error message if the input format is incorrect.
+    }
+}
 
-        int status;
-        waitpid(pid, &status, 0); // Wait for the child process to finish
-        //cout << "Command executed, child exited with status " << WEXITSTATUS(status) << endl;
-
-        // Restore original stdout and stdin if they were redirected
-        if (saved_stdout != -1) {
-            dup2(saved_stdout, STDOUT_FILENO);
-            close(saved_stdout);
+/**
+ * Handles the "export" builtin. "export name[=value] ..." passes variables to launched commands,
+ * assigning them first when a value is given. With no names, or with -p, it lists them.
+ * @param tokens The command tokens, starting with "export".
+ */
+int handleExportBuiltin(const vector<string>& tokens) {
+    if (tokens.size() == 1 || (tokens.size() == 2 && tokens[1] == "-p")) {
+        vector<const ShellVariable*> exported;
+        for (const ShellVariable& variable : shellVariables.slots) {
+            if (!variable.name.empty() && !variable.deleted && variable.exported) exported.push_back(&variable);
+        }
+        sort(exported.begin(), exported.end(), [](const ShellVariable* a, const ShellVariable* b) { return a->name < b->name; });
+        string listing;
+        for (const ShellVariable* variable : exported) {
+            listing += "export " + variable->name + "='";
+            for (char c : variable->value) listing += c == '\'' ? string("'\\''") : string(1, c);
+            listing += "'\n";
+        }
+        write(STDOUT_FILENO, listing.data(), listing.size());
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        string_view name = string_view(tokens[i]).substr(0, tokens[i].find('='));
+        if (!isValidName(name)) {
+            cerr << "mish: export: `" << tokens[i] << "': not a valid identifier" << endl;
+            status = 1;
+            continue;
         }
-        if (saved_stdin != -1) {
-            dup2(saved_stdin, STDIN_FILENO);
-            close(saved_stdin);
+        if (name.size() != tokens[i].size()) handleVariableAssignment(tokens[i]);
+        exportVariable(name);
+    }
+    return status;
+}
+
+/**
+ * Handles the "unset" builtin, which removes variables.
+ * @param tokens The command tokens, starting with "unset".
+ */
+int handleUnsetBuiltin(const vector<string>& tokens) {
+    int status = 0;
+    for (size_t i = 1; i < tokens.size(); ++i) {
+        if (tokens[i] == "-v") continue;
+        if (!isValidName(tokens[i])) {
+            cerr << "mish: unset: `" << tokens[i] << "': not a valid identifier" << endl;
+            status = 1;
+            continue;
         }
+        if (tokens[i] == "PATH") commandHash.clear();
+        unsetVariable(tokens[i]);
     }
+    return status;
 }
 
 /**
- * Executes a series of piped commands.
- * @param tokens The complete command line input split into tokens.
+ * Handles the "exec" builtin. Without a command its redirections stay in effect for the shell
+ * itself, so "exec 3>>log" opens a log once for every later command, which inherits it, and
+ * "exec 3>&-" closes it again. With a command the shell is replaced by it.
+ * @param command The expanded command, starting with "exec".
+ * @return The exit status; with a command it only returns if the command was not found.
  */
-void executePipedCommand(const vector<string>& tokens) {
-    vector<vector<string>> commands;  // Store individual commands separated by pipes
-    vector<int> fds;             // Store file descriptors for pipes
-    vector<pid_t> child_pids;         // Store child process IDs
+int handleExecBuiltin(const SimpleCommand& command) {
+    FdActions actions;
+    ArenaVector<int> opened;
+    if (!redirectionActions(command.redirections, actions, opened)) return 1;
+    string path;
+    if (command.args.size() > 1 && !resolveCommand(command.args[1], path, assignedPath(command.assignments))) {
+        for (int fd : opened) close(fd);
+        return reportSpawnError(command.args[1].c_str(), ENOENT);
+    }
+    int status = applyShellActions(actions, opened, nullptr) ? 0 : 1; // Inherited by every command from now on.
+    for (int fd : opened) close(fd);
+    if (command.args.size() == 1) return status;
+
+    ArenaVector<char*> argv;
+    for (size_t i = 1; i < command.args.size(); ++i) argv.push_back(const_cast<char*>(command.args[i].c_str()));
+    argv.push_back(nullptr);
+    for (int sig : jobControlSignals) signal(sig, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, nullptr);
+    execve(path.c_str(), argv.data(), environmentWith(command.assignments));
+    _exit(reportSpawnError(argv[0], errno)); // The shell can't carry on with its signals reset.
+}
 
-    // Split the input into separate commands at each pipe symbol
-    auto startIt = tokens.begin();
-    while (startIt != tokens.end()) {
-        auto pipeIt = find(startIt, tokens.end(), "|");
-        commands.emplace_back(startIt, pipeIt);
-        if (pipeIt != tokens.end()) startIt = next(pipeIt);
-        else break;
+/**
+ * Handles the "set" builtin, which views and changes shell options.
+ * "set -o" lists the options, "set -o name" turns one on, "set +o name" turns it off,
+ * and "set -o name=value" gives one a value.
+ * @param tokens The command tokens, starting with "set".
+ */
+int handleSetBuiltin(const vector<string>& tokens) {
+    if (tokens.size() == 1 || (tokens.size() == 2 && tokens[1] == "-o")) {
+        cout << "argbatch       \t" << (argumentBatches ? to_string(argumentBatches) : "off") << endl;
+        cout << "launchers      \t" << pipelineLaunchers << endl;
+        cout << "notify         \t" << (notifyImmediately ? "on" : "off") << endl;
+        cout << "pipefail       \t" << (pipefail ? "on" : "off") << endl;
+        cout << "pipegrow       \t" << (pipeGrow ? "on" : "off") << endl;
+        cout << "pipesize       \t" << (pipeSize ? to_string(pipeSize) : "default") << endl;
+        cout << "pipestats      \t" << (pipeStats ? "on" : "off") << endl;
+        cout << "pipestop       \t" << (pipeStop ? signalName(pipeStop) : "off") << endl;
+        cout << "spawn          \t" << spawnBackendName(spawnBackend) << endl;
+        cout << "treewalk       \t" << (treeWalker ? "on" : "off") << endl;
+        return 0;
+    }
+    if (tokens.size() != 3 || (tokens[1] != "-o" && tokens[1] != "+o")) {
+        cerr << "Usage: set [-o|+o] [option[=value]]" << endl;
+        return 2;
     }
 
-    int in_fd = STDIN_FILENO;  // Input file descriptor starts as STDIN
+    bool enable = tokens[1] == "-o";
+    const string& option = tokens[2];
+    size_t equalPos = option.find('=');
+    string name = option.substr(0, equalPos);
+    string value = equalPos == string::npos ? "" : option.substr(equalPos + 1);
 
-    // Loop over commands to set up pipes and fork processes
-    for (size_t i = 0; i < commands.size(); ++i) {
-        int fd[2];
-        // Set up pipe for all but the last command
-        if (i < commands.size() - 1 && pipe(fd) == -1) {
-            if (pipe(fd) == -1) {
-                perror("pipe");
-                exit(EXIT_FAILURE);
+    if (name == "argbatch") {
+        if (!enable) {
+            argumentBatches = 0;
+        } else if (value.empty()) {
+            argumentBatches = 1;
+        } else if (value == "parallel") {
+            argumentBatches = max(1u, thread::hardware_concurrency());
+        } else if (all_of(value.begin(), value.end(), ::isdigit) && atoi(value.c_str()) > 0) {
+            argumentBatches = atoi(value.c_str());
+        } else {
+            cerr << "mish: set: invalid batch count '" << value << "'" << endl;
+            return 1;
+        }
+    } else if (name == "launchers") {
+        if (!enable) {
+            pipelineLaunchers = 1;
+        } else if (value.empty()) {
+            pipelineLaunchers = max(1u, min(thread::hardware_concurrency(), 8u));
+        } else if (all_of(value.begin(), value.end(), ::isdigit) && atoi(value.c_str()) > 0) {
+            pipelineLaunchers = min(atoi(value.c_str()), 64);
+        } else {
+            cerr << "mish: set: invalid launcher count '" << value << "'" << endl;
+            return 1;
+        }
+    } else if (name == "notify") {
+        notifyImmediately = enable;
+    } else if (name == "pipefail") {
+        pipefail = enable;
+    } else if (name == "pipegrow") {
+        pipeGrow = enable;
+    } else if (name == "pipestats") {
+        pipeStats = enable;
+    } else if (name == "pipestop") {
+        int sig = !enable ? 0 : value.empty() ? SIGPIPE : parseSignal(value);
+        if (sig < 0 || sig >= NSIG) {
+            cerr << "mish: set: invalid signal '" << value << "'" << endl;
+            return 1;
+        }
+        pipeStop = sig;
+    } else if (name == "pipesize") {
+        int size = 0;
+        if (!enable || value == "default") {
+            pipeSize = 0;
+        } else if (parseSize(value, size)) {
+            if (size > maxPipeSize()) {
+                cerr << "mish: set: pipesize limited to " << maxPipeSize() << " by /proc/sys/fs/pipe-max-size" << endl;
             }
-            fds.push_back(fd[0]); // Save the read end to close later
-            fds.push_back(fd[1]); // Save the write end to close later
+            pipeSize = min(size, maxPipeSize());
+        } else {
+            cerr << "mish: set: invalid pipe size '" << value << "'" << endl;
+            return 1;
         }
+    } else if (name == "spawn") {
+        if (equalPos == string::npos) {
+            cout << "spawn          \t" << spawnBackendName(spawnBackend) << endl;
+        } else if (!parseSpawnBackend(value, spawnBackend)) {
+            cerr << "mish: set: unknown spawn backend '" << value << "' (posix_spawn, vfork, fork)" << endl;
+            return 1;
+        }
+    } else if (name == "treewalk") {
+        treeWalker = enable;
+    } else {
+        cerr << "mish: set: " << name << ": invalid option name" << endl;
+        return 1;
+    }
+    return 0;
+}
 
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            exit(EXIT_FAILURE);
-        } else if (pid == 0) {  // Child process
-            // Handle input redirection for the first command
-            if (i == 0) {
-                int redirectInIndex = findTokenIndex(commands[i], "<");
-                if (redirectInIndex != -1 && redirectInIndex + 1 < commands[i].size()) {
-                    in_fd = open(commands[i][redirectInIndex + 1].c_str(), O_RDONLY);
-                    if (in_fd == -1) {
-                        perror("syntax error, unexpected PIPE, expecting STRING");
-                        //exit(EXIT_FAILURE);
-                    }
-                    dup2(in_fd, STDIN_FILENO);
-                    close(in_fd);
-                    commands[i].erase(commands[i].begin() + redirectInIndex, commands[i].begin() + redirectInIndex + 2);
-                }
-            }
+bool exitRequested = false; // Set by "exit"; no further commands run in this shell or subshell.
+int substitutionStatus = -1; // Status of the last command substitution in the command being expanded, or -1.
+vector<int> processSubstitutions; // The shell's ends of the pipes to running <(...) and >(...) commands.
 
-            // Redirect input from the previous pipe
-            if (in_fd != STDIN_FILENO) {
-                dup2(in_fd, STDIN_FILENO);
-                close(in_fd);
-            }
+/**
+ * Closes the shell's ends of the process substitutions made since a mark, once the command
+ * using them has been launched, so their commands see end of file or a broken pipe when it
+ * is done with them.
+ * @param mark The number of substitutions that were open before the command was expanded.
+ */
+void closeProcessSubstitutions(size_t mark) {
+    while (processSubstitutions.size() > mark) {
+        close(processSubstitutions.back());
+        processSubstitutions.pop_back();
+    }
+}
 
-            // Set up output redirection for all but the last command
-            if (i < commands.size() - 1) {
-                dup2(fd[1], STDOUT_FILENO);
-                close(fd[0]);
-                close(fd[1]);
-            }
+/**
+ * Tells whether a word has the form name=value, which assigns a variable.
+ */
+bool isAssignment(string_view word) {
+    size_t equalPos = word.find('=');
+    return equalPos != string_view::npos && isValidName(word.substr(0, equalPos));
+}
 
-            // Handle output redirection for the last command
-            if (i == commands.size() - 1) {
-                int redirectOutIndex = findTokenIndex(commands[i], ">");
-                if (redirectOutIndex != -1 && redirectOutIndex + 1 < commands[i].size()) {
-                    int out_fd = open(commands[i][redirectOutIndex + 1].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if (out_fd == -1) {
-                        perror("open for output redirection failed");
-                        exit(EXIT_FAILURE);
-                    }
-                    dup2(out_fd, STDOUT_FILENO);
-                    close(out_fd);
-                    commands[i].erase(commands[i].begin() + redirectOutIndex,
-                                      commands[i].begin() + redirectOutIndex + 2);
-                }
-            }
+/**
+ * Tells whether a command changes the shell's own state, such as its directory, variables or
+ * jobs. Inside a pipeline or in the background such a command runs in a subshell, where the
+ * change has no effect on the shell, as in sh.
+ */
+bool changesShellState(const SimpleCommand& command) {
+    static const char* names[] = {"cd", "exit", "exec", "jobs", "fg", "bg", "wait", "kill", "hash", "set", "export", "unset"};
+    const vector<string>& args = command.args;
+    if (args.empty()) return !command.assignments.empty();
+    return any_of(std::begin(names), std::end(names), [&](const char* name) { return args[0] == name; });
+}
 
-            // Execute the command
-            vector<char *> args = segment_args(commands[i]);
-            execvp(args[0], args.data());
-            cerr << "mish: '" << args[0] << "': No such file or directory" << endl;
-            exit(EXIT_FAILURE);
-        } else {
-            child_pids.push_back(pid);  // Parent process, store child pid
-            if (in_fd != STDIN_FILENO) {
-                close(in_fd);  // Close the read end of the previous pipe
+/**
+ * Expands a command's words and the targets of its redirections.
+ * @param node The command as parsed.
+ * @param command Receives the expanded command.
+ * @return false if a redirection does not expand to exactly one word, which is reported.
+ */
+bool expandCommand(const Node* node, SimpleCommand& command) {
+    substitutionStatus = -1;
+    command.args.clear();
+    command.assignments.clear();
+    command.redirections.clear();
+    command.text = node->text;
+    size_t i = 0;
+    for (; i < node->words.size() && isAssignment(node->words[i].text); ++i) {
+        expandWord(node->words[i].text, command.assignments, false);
+    }
+    command.spreadBegin = command.spreadEnd = 0;
+    for (; i < node->words.size(); ++i) {
+        size_t first = command.args.size();
+        expandWord(node->words[i].text, command.args);
+        if (command.args.size() - first > command.spreadEnd - command.spreadBegin) {
+            command.spreadBegin = first;
+            command.spreadEnd = command.args.size();
+        }
+    }
+    for (const RedirectWord& redirect : node->redirects) {
+        if (redirect.kind == RedirectWord::HereDocument) {
+            string_view delimiter = redirect.target.text, body = redirect.target.document;
+            string data;
+            if (redirect.stripTabs) { // "<<-" drops the leading tabs of every line.
+                for (size_t start = 0; start < body.size();) {
+                    size_t end = min(body.find('\n', start), body.size() - 1) + 1;
+                    string_view line = body.substr(start, end - start);
+                    data.append(line.substr(min(line.find_first_not_of('\t'), line.size())));
+                    start = end;
+                }
+                body = data;
             }
-            if (i < commands.size() - 1) {
-                close(fd[1]);  // Close the write end of the current pipe
-                in_fd = fd[0]; // The next command will read from here
+            bool quoted = delimiter.find_first_of("'\"\\") != string_view::npos; // Then the body is taken literally.
+            command.redirections.push_back({redirect.fd, redirect.flags, quoted ? string(body) : expandHereDocument(body), Redirection::Data});
+            continue;
+        }
+        size_t words = command.args.size();
+        expandWord(redirect.target.text, command.args, redirect.kind != RedirectWord::HereString); // Borrows the end of args for the target.
+        if (command.args.size() != words + 1) {
+            cerr << "mish: " << redirect.target.text << ": ambiguous redirect" << endl;
+            return false;
+        }
+        command.redirections.push_back({redirect.fd, redirect.flags, move(command.args.back())});
+        command.args.pop_back();
+        Redirection& redirection = command.redirections.back();
+        if (redirect.kind == RedirectWord::HereString) { // The word itself is the input, with a newline added.
+            redirection.path += '\n';
+            redirection.kind = Redirection::Data;
+        } else if (redirect.kind == RedirectWord::Duplicate) {
+            const string& target = redirection.path;
+            if (target == "-") {
+                redirection.kind = Redirection::Close;
+            } else if (!target.empty() && target.size() <= 4 && all_of(target.begin(), target.end(), ::isdigit)) {
+                redirection.kind = Redirection::Duplicate;
+                redirection.source = atoi(target.c_str());
+            } else if (redirect.fd == STDOUT_FILENO) { // >&file is &>file.
+                redirection.flags = O_WRONLY | O_CREAT | O_TRUNC;
+                command.redirections.push_back({STDERR_FILENO, 0, "1", Redirection::Duplicate, STDOUT_FILENO});
+            } else {
+                cerr << "mish: " << target << ": ambiguous redirect" << endl;
+                return false;
             }
         }
     }
+    return true;
+}
 
-    for (int fd : fds) {
-        close(fd);
+/**
+ * Runs one of the builtins that change or report the shell's state, such as cd, jobs or set.
+ * Its redirections are applied to the shell's own descriptors while it runs and then undone,
+ * as for a redirected { } group, so "cd dir 2>/dev/null" and "jobs > list" work in the shell.
+ */
+void executeShellBuiltin(const SimpleCommand& command) {
+    const vector<string>& args = command.args;
+    vector<pair<int, int>> saved;
+    if (!command.redirections.empty()) {
+        FdActions actions;
+        ArenaVector<int> opened;
+        bool applied = redirectionActions(command.redirections, actions, opened) && applyShellActions(actions, opened, &saved);
+        for (int fd : opened) close(fd);
+        if (!applied) {
+            restoreShellFds(saved);
+            lastExitStatus = 1;
+            pipeStatus = {lastExitStatus};
+            return;
+        }
     }
 
-    // Wait for all the child processes to finish
-    for (pid_t pid : child_pids) {
-        int status;
-        waitpid(pid, &status, 0);  // This waits for the specific child process to finish
+    if (args[0] == "cd") { // If the first token is "cd", attempts to change the directory.
+        lastExitStatus = 0;
+        if (args.size() == 2) {
+            if (chdir(args[1].c_str()) != 0) {
+                perror("cd failed");
+                lastExitStatus = 1;
+            }
+        } else {
+            cerr << "Usage: cd <directory>" << endl;
+            lastExitStatus = 2;
+        }
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "jobs") {
+        lastExitStatus = handleJobsBuiltin(args);
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "fg" || args[0] == "bg") {
+        lastExitStatus = handleFgBgBuiltin(args); // fg leaves PIPESTATUS to the resumed job.
+    } else if (args[0] == "wait") {
+        lastExitStatus = handleWaitBuiltin(args);
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "kill") {
+        lastExitStatus = handleKillBuiltin(args);
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "hash") {
+        lastExitStatus = handleHashBuiltin(args);
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "set") {
+        lastExitStatus = handleSetBuiltin(args);
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "export") {
+        lastExitStatus = handleExportBuiltin(args);
+        pipeStatus = {lastExitStatus};
+    } else if (args[0] == "unset") {
+        lastExitStatus = handleUnsetBuiltin(args);
+        pipeStatus = {lastExitStatus};
     }
+    restoreShellFds(saved);
+}
 
-    cout << flush;
+/**
+ * Runs an expanded simple command: an assignment, a builtin, or a program launched as a job.
+ * @param command The command.
+ * @param background Whether it was followed by "&".
+ */
+void executeSimpleCommand(const SimpleCommand& command, bool background) {
+    const vector<string>& args = command.args;
+    if (background && changesShellState(command)) {
+        ArenaVector<PipelineStage> stages(1);
+        stages[0].name = args.empty() ? string(command.text) : args[0];
+        stages[0].subshell = [command]() {
+            executeSimpleCommand(command, false);
+            return lastExitStatus;
+        };
+        executePipedCommand(stages, command.text, true, PipelineOptions());
+        return;
+    }
+    if (args.empty()) {
+        // Only assignments, such as "PATH=/usr/bin", and redirections, whose files are created.
+        lastExitStatus = substitutionStatus == -1 ? 0 : substitutionStatus; // As in x=$(false).
+        FdActions actions;
+        ArenaVector<int> opened;
+        if (!redirectionActions(command.redirections, actions, opened)) lastExitStatus = 1;
+        for (int fd : opened) close(fd);
+        for (const string& assignment : command.assignments) handleVariableAssignment(assignment);
+        pipeStatus = {lastExitStatus};
+        return;
+    }
 
+    if (args[0] == "exit") { // Leaves the shell with the given status, or that of the last command.
+        if (args.size() > 1) lastExitStatus = atoi(args[1].c_str()) & 0xff;
+        exitRequested = true;
+    } else if (args[0] == "exec") { // Keeps its redirections for the shell, or replaces it with a command.
+        lastExitStatus = handleExecBuiltin(command);
+        pipeStatus = {lastExitStatus};
+    } else if (simpleBuiltins.count(args[0])) {
+        // echo, printf, pwd, test and friends run in the shell, even with "&"
+        lastExitStatus = executeBuiltin(command, simpleBuiltins.at(args[0]));
+        pipeStatus = {lastExitStatus};
+    } else if (!background && treeWalkerFor(args)) {
+        // find and du walk the tree on a thread pool in the shell
+        InterruptScope interrupt; // The walk runs on the main thread, which Ctrl-C interrupts.
+        lastExitStatus = executeBuiltin(command, treeWalkerFor(args));
+        pipeStatus = {lastExitStatus};
+        if (interrupt.interrupted()) {
+            cout << endl;
+            lineInterrupted = true;
+        }
+    } else if (!background && isCatCopy(command)) {
+        // A plain file copy is done in the kernel without starting cat
+        lastExitStatus = executeCatCopy(command);
+        pipeStatus = {lastExitStatus};
+    } else if (changesShellState(command)) {
+        // cd, jobs, set, export and the like change or report the shell's own state
+        executeShellBuiltin(command);
+    } else if (!command.redirections.empty()) {
+        // The command contains redirection
+        executeCommand(command, background);
+    } else if (args[0] == "ls" && args.size() == 2 && args[1] == "-al") {
+        // Specific handling for 'ls -al'
+        executeCommand(command, background);
+    } else if (args[0] == "ls") { // If the command is "ls", lists directories and files.
+        executeCommand(command, background);
+        // listDirectoriesAndFiles(args.size() > 1 ? args[1] : getCurrentDirectory()); // Passes a specific directory if provided, otherwise uses the current directory.
+    } else if (args[0] == "rm") { // Handles the "rm" command to remove files or directories.
+        // Further processing for "rm" command.
+    } else if (args[0] == "clear") {
+        write(STDOUT_FILENO, "\033[H\033[2J", 7);
+    } else if (args[0] == "emacs") {
+        executeCommand(command, background);
+    } else {
+        executeCommand(command, background); // Executes the command specified by the tokens.
+    }
 }
 
 /**
- * Retrieves the current working directory as a string.
- * @return The current working directory.
+ * Expands and runs a simple command that is not part of a pipeline.
  */
-string getCurrentDirectory() {
-    char* cwd = getcwd(nullptr, 0); // Calls getcwd with nullptr and 0, which allocates a buffer of sufficient size automatically.
-    string currentDirStr(cwd); // Constructs a C++ string from the C-style string returned by getcwd.
-    free(cwd); // Frees the memory allocated by getcwd since it's no longer needed.
-    return currentDirStr; // Returns the current working directory as a C++ string.
+void runSimpleCommand(const Node* node, bool background) {
+    static SimpleCommand command; // Reused, so short commands need no new allocations.
+    size_t mark = processSubstitutions.size();
+    if (!expandCommand(node, command)) {
+        lastExitStatus = 1;
+        pipeStatus = {lastExitStatus};
+    } else {
+        executeSimpleCommand(command, background);
+    }
+    closeProcessSubstitutions(mark);
 }
 
+int runNode(const Node* node);
+
 /**
- * Checks if a command is intended to be run in the background.
- * @param cmd The command string.
- * @return true if the command ends with an '&', false otherwise.
+ * Adds the stage for one node of a pipeline. A compound command, or a command that changes the
+ * shell's state, runs in a forked subshell; any other command is expanded now.
  */
-bool isBackgroundCommand(const string& cmd) {
-    return !cmd.empty() && cmd.back() == '&'; // Checks if the command is not empty and if the last character is '&'.
+void addPipelineStage(ArenaVector<PipelineStage>& stages, const Node* node) {
+    stages.emplace_back();
+    PipelineStage& stage = stages.back();
+    stage.name = string(node->text);
+    if (node->kind != Node::Command) {
+        const Node* body = node->kind == Node::Subshell || node->kind == Node::Group ? node->children[0] : node;
+        stage.subshell = [body]() { return runNode(body); };
+        if (!node->redirects.empty()) { // Opened once by the shell, then applied in the subshell before the body runs.
+            SimpleCommand command;
+            stage.failed = !expandCommand(node, command);
+            stage.redirections = move(command.redirections);
+        }
+        return;
+    }
+    SimpleCommand command;
+    stage.failed = !expandCommand(node, command);
+    if (!command.args.empty()) stage.name = command.args[0];
+    if (changesShellState(command) || needsArgumentBatches(command, environmentWith(command.assignments))) {
+        stage.subshell = [command]() {
+            executeSimpleCommand(command, false);
+            return lastExitStatus;
+        };
+    } else {
+        stage.args = move(command.args);
+        stage.assignments = move(command.assignments);
+        stage.redirections = move(command.redirections);
+    }
 }
 
 /**
- * Handles environment variable assignment within the shell.
- * @param input The full input string containing the assignment.
+ * Runs a pipeline, or a subshell or other compound command that must run as a job of its own.
+ * @param node The pipeline or compound command.
+ * @param background Whether to return to the prompt without waiting.
  */
-void handleVariableAssignment(const string& input) {
-    size_t equalPos = input.find('='); // Finds the position of the '=' character.
-    if (equalPos != string::npos) { // Checks if '=' was found.
-        string varName = input.substr(0, equalPos); // Extracts the variable name from the input.
-        string value = input.substr(equalPos + 1); // Extracts the variable value.
+void runPipeline(const Node* node, bool background) {
+    ArenaVector<PipelineStage> stages;
+    PipelineOptions options;
+    size_t mark = processSubstitutions.size();
+    if (node->kind == Node::Pipeline) {
+        stages.reserve(node->children.size());
+        for (const Node* stage : node->children) addPipelineStage(stages, stage);
+        options = node->options;
+    } else {
+        addPipelineStage(stages, node);
+    }
+    executePipedCommand(stages, node->text, background, options);
+    closeProcessSubstitutions(mark);
+    if (node->negated && !background) lastExitStatus = lastExitStatus == 0;
+}
 
-        if (varName == "PATH" && value.empty()) { // Special case for PATH variable being set to empty.
-            unsetenv("PATH"); // Unsets the PATH environment variable.
-        } else {
-            setenv(varName.c_str(), value.c_str(), 1); // Sets or updates the environment variable. The '1' argument means overwrite existing value.
-        }
+/**
+ * Runs a { } group with redirections in the shell itself. They are applied to the shell's own
+ * descriptors for the length of the group and then undone, so "{ a; b; c; } > out" opens out
+ * once, builtins in the group run in the shell and write to it, and commands inherit it.
+ */
+void runRedirectedGroup(const Node* node) {
+    SimpleCommand command;
+    FdActions actions;
+    ArenaVector<int> opened;
+    size_t mark = processSubstitutions.size();
+    if (!expandCommand(node, command) || !redirectionActions(command.redirections, actions, opened)) {
+        closeProcessSubstitutions(mark);
+        lastExitStatus = 1;
+        pipeStatus = {lastExitStatus};
+        return;
+    }
+    vector<pair<int, int>> saved;
+    bool applied = applyShellActions(actions, opened, &saved);
+    for (int fd : opened) close(fd);
+    closeProcessSubstitutions(mark);
+    if (applied) {
+        runNode(node->children[0]);
     } else {
-        cerr << "Invalid assignment format." << endl; // Prints an error message if the input format is incorrect.
+        lastExitStatus = 1;
+        pipeStatus = {lastExitStatus};
     }
+    restoreShellFds(saved);
 }
 
 /**
- * Executes a command in the background by forking and not waiting for the process to finish.
- * @param tokens The command and its arguments.
+ * Runs a parsed command line, or part of one. The right side of && runs only if the left
+ * succeeded, and that of || only if it failed. A list stops early after "exit", or when a
+ * foreground job is interrupted with Ctrl-C.
+ * @param node The tree to run.
+ * @return The exit status, which is also left in $?.
  */
-void executeCommandInBackground(const vector<string>& tokens) {
-    pid_t pid = fork();
-    if (pid == 0) {
-        vector<char*> args = segment_args(tokens);
-        execvp(args[0], args.data());
-        cerr << "mish: '" << args[0] << "': No such file or directory" << endl;
-        exit(EXIT_FAILURE);
+int runNode(const Node* node) {
+    switch (node->kind) {
+        case Node::Sequence:
+            for (const Node* item : node->children) {
+                if (exitRequested || lineInterrupted) break;
+                if (item->background && item->kind == Node::Command) runSimpleCommand(item, true);
+                else if (item->background) runPipeline(item, true);
+                else runNode(item);
+            }
+            break;
+        case Node::And:
+        case Node::Or:
+            runNode(node->children[0]);
+            if (exitRequested || lineInterrupted) break;
+            if ((lastExitStatus == 0) == (node->kind == Node::And)) runNode(node->children[1]);
+            break;
+        case Node::Group:
+            if (node->redirects.empty()) runNode(node->children[0]);
+            else runRedirectedGroup(node);
+            break;
+        case Node::Command:
+            runSimpleCommand(node, false);
+            break;
+        default: // Pipelines and subshells
+            runPipeline(node, false);
     }
+    return lastExitStatus;
 }
 
 /**
- * Checks for the presence of multiple redirections or an improper mix of pipes and redirections.
- * This function is intended to validate the syntax of shell commands where only certain arrangements
- * of pipes and redirections are syntactically valid.
- *
- * @param tokens The vector of command tokens to be analyzed.
- * @return true if there are multiple redirections or improper mixes, false otherwise.
+ * Reads a descriptor to end of file into a buffer that grows as needed.
+ */
+void readAll(int fd, string& output) {
+    size_t used = output.size();
+    while (true) {
+        if (output.size() - used < 16384) output.resize(max<size_t>(output.size() * 2, 65536));
+        ssize_t n = read(fd, &output[used], output.size() - used);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        used += n;
+    }
+    output.resize(used);
+}
+
+/**
+ * Runs the command of a $(...) or `...` substitution with its standard output on a pipe, and
+ * reads what it writes, without trailing newlines. A lone builtin such as echo or printf runs
+ * on a helper thread in the shell, a lone program is launched directly, and anything else
+ * runs in a forked subshell. $? becomes the command's status.
+ * @param text The command between the parentheses or backquotes.
+ * @param backquoted Whether it was written in backquotes, where a backslash escapes $, ` and \.
+ * @param output Receives the output.
  */
-bool hasMultipleRedirectionsOrPipes(const vector<string>& tokens) {
-    int redirectInCount = count(tokens.begin(), tokens.end(), "<");
-    int redirectOutCount = count(tokens.begin(), tokens.end(), ">");
-    int pipeCount = count(tokens.begin(), tokens.end(), "|");
+void substituteCommand(string_view text, bool backquoted, string& output) {
+    if (backquoted) {
+        string unescaped;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '\\' && i + 1 < text.size() && strchr("$`\\", text[i + 1])) i++;
+            unescaped += text[i];
+        }
+        text = commandArena.copyString(unescaped); // The tree points into it while the command runs.
+    }
+    Node* program;
+    ParseStatus parsed = parseCommandLine(text, program, true);
+    if (parsed == ParseStatus::Incomplete) {
+        cerr << "mish: syntax error: unexpected end of command substitution" << endl;
+        lastExitStatus = 2;
+    }
+    if (parsed != ParseStatus::Complete) return;
+    lastExitStatus = 0;
+    if (!program) return;
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        lastExitStatus = 1;
+        return;
+    }
 
-    if (redirectInCount > 1) {
-        cerr << "mish: multiple input redirect or pipe" << endl;
-        return true;
+    SpawnOptions options;
+    options.foreground = true;
+    SimpleCommand command;
+    BuiltinFunction builtin = nullptr;
+    bool simple = program->kind == Node::Command;
+    size_t mark = processSubstitutions.size();
+    if (simple && !expandCommand(program, command)) {
+        close(fd[0]);
+        close(fd[1]);
+        closeProcessSubstitutions(mark);
+        lastExitStatus = 1;
+        return;
     }
-    if (redirectOutCount > 1) {
-        cerr << "mish: multiple output redirect or pipe" << endl;
-        return true;
+    bool lone = simple && !command.args.empty();
+    if (lone && command.redirections.empty()) {
+        auto found = simpleBuiltins.find(command.args[0]);
+        builtin = found != simpleBuiltins.end() ? found->second : treeWalkerFor(command.args);
     }
-    if (pipeCount > 0 && (redirectInCount > 0 || redirectOutCount > 0)) {
-        // Checking specifically for cases where pipes and redirections might not be properly sequenced
-        // E.g., cases like `cat file1.txt > file2.txt > file3.txt` or improper mixing should trigger this
-        bool errorFound = false;
-        for (int i = 0; i < tokens.size(); i++) {
-            if (tokens[i] == "|") {
-                if ((i > 0 && (tokens[i-1] == ">" || tokens[i-1] == "<")) ||
-                    (i < tokens.size() - 1 && (tokens[i+1] == ">" || tokens[i+1] == "<"))) {
-                    cerr << "Error: Improper mixing of pipes and redirections." << endl;
-                    errorFound = true;
-                    break;
-                }
+
+    pid_t pid = -1;
+    int error = 0;
+    if (builtin) { // No process at all: a helper thread writes into the pipe while we read it.
+        int status = 0;
+        thread writer([&]() {
+            status = runBuiltin(builtin, command.args, fd[1]);
+            close(fd[1]);
+        });
+        readAll(fd[0], output);
+        writer.join();
+        lastExitStatus = status;
+    } else {
+        if (lone && !changesShellState(command)) {
+            ArenaVector<char*> argv;
+            for (const string& arg : command.args) argv.push_back(const_cast<char*>(arg.c_str()));
+            argv.push_back(nullptr);
+            FdActions actions;
+            ArenaVector<int> opened;
+            actions.push_back(dupAction(fd[1], STDOUT_FILENO));
+            if (redirectionActions(command.redirections, actions, opened)) {
+                options.environment = environmentWith(command.assignments);
+                options.path = assignedPath(command.assignments);
+                pid = launchCommand(argv.data(), actions, options, error);
+                for (int descriptor : opened) close(descriptor);
+                if (pid == -1) lastExitStatus = reportSpawnError(argv[0], error);
+            } else {
+                lastExitStatus = 1;
+            }
+        } else {
+            function<int()> body = [program]() { return runNode(program); };
+            if (simple) { // Already expanded, so the subshell must not expand it again.
+                body = [&command]() {
+                    executeSimpleCommand(command, false);
+                    return lastExitStatus;
+                };
+            }
+            FdActions actions;
+            actions.push_back(dupAction(fd[1], STDOUT_FILENO));
+            pid = forkSubshell(body, actions, options, error);
+            if (pid == -1) {
+                cerr << "mish: fork: " << strerror(error) << endl;
+                lastExitStatus = 1;
             }
         }
-        if (errorFound) {
-            return true;
+        close(fd[1]);
+        readAll(fd[0], output);
+    }
+    close(fd[0]);
+    closeProcessSubstitutions(mark);
+    if (pid != -1) {
+        Job job;
+        job.pgid = pid;
+        job.processes.push_back({pid});
+        job.command = string(text);
+        startJob(move(job), false);
+    }
+    while (!output.empty() && output.back() == '\n') output.pop_back();
+    substitutionStatus = lastExitStatus;
+}
+
+/**
+ * Starts the command of a <(...) or >(...) process substitution on a pipe and leaves it
+ * running alongside the command that uses it, the way executePipedCommand runs its stages.
+ * The shell's end of the pipe loses close-on-exec, so whatever is launched for the current
+ * command inherits it under the same number, until closeProcessSubstitutions closes it. The
+ * command is not a job; it is reaped whenever it exits, like bash does.
+ * @param text The command between the parentheses.
+ * @param reading true for <(...), whose output is read; false for >(...), whose input is written.
+ * @return The path naming the shell's end, such as /dev/fd/5, or an empty string on failure.
+ */
+string substituteProcess(string_view text, bool reading) {
+    Node* program;
+    ParseStatus parsed = parseCommandLine(text, program, true);
+    if (parsed == ParseStatus::Incomplete) cerr << "mish: syntax error: unexpected end of process substitution" << endl;
+    if (parsed != ParseStatus::Complete) return "";
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return "";
+    }
+    int shellEnd = reading ? fd[0] : fd[1], commandEnd = reading ? fd[1] : fd[0];
+
+    SpawnOptions options;
+    options.pgid = shellPgid; // Outside any job, so it never takes the terminal.
+    SimpleCommand command;
+    bool simple = program && program->kind == Node::Command;
+    size_t mark = processSubstitutions.size(); // Those before it belong to the outer command.
+    if (simple && !expandCommand(program, command)) program = nullptr;
+    bool lone = simple && program && !command.args.empty() && !simpleBuiltins.count(command.args[0]) &&
+                !treeWalkerFor(command.args) && !changesShellState(command);
+
+    int error = 0;
+    if (lone) { // A single program is launched directly.
+        ArenaVector<char*> argv;
+        for (const string& arg : command.args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+        FdActions actions;
+        ArenaVector<int> opened;
+        actions.push_back(dupAction(commandEnd, reading ? STDOUT_FILENO : STDIN_FILENO));
+        for (size_t i = 0; i < mark; ++i) actions.push_back(closeAction(processSubstitutions[i]));
+        if (redirectionActions(command.redirections, actions, opened)) {
+            options.environment = environmentWith(command.assignments);
+            options.path = assignedPath(command.assignments);
+            if (launchCommand(argv.data(), actions, options, error) == -1) reportSpawnError(argv[0], error);
+            for (int descriptor : opened) close(descriptor);
+        }
+    } else if (program) {
+        function<int()> body = [program]() { return runNode(program); };
+        if (simple) { // Already expanded, so the subshell must not expand it again.
+            body = [&command]() {
+                executeSimpleCommand(command, false);
+                return lastExitStatus;
+            };
+        }
+        auto run = [&body, mark]() {
+            for (size_t i = 0; i < mark; ++i) close(processSubstitutions[i]);
+            processSubstitutions.erase(processSubstitutions.begin(), processSubstitutions.begin() + mark);
+            return body();
+        };
+        FdActions actions;
+        actions.push_back(dupAction(commandEnd, reading ? STDOUT_FILENO : STDIN_FILENO));
+        if (forkSubshell(run, actions, options, error) == -1) {
+            cerr << "mish: fork: " << strerror(error) << endl;
         }
     }
+    close(commandEnd);
+    closeProcessSubstitutions(mark);
+    shellEnd = moveShellFd(shellEnd);
+    fcntl(shellEnd, F_SETFD, 0);
+    processSubstitutions.push_back(shellEnd);
+    return "/dev/fd/" + to_string(shellEnd);
+}
 
-    return false;
+/**
+ * Prints the prompt showing the current directory relative to ~/.mish when inside it.
+ */
+void printPrompt() {
+    char cwd[PATH_MAX]; // A stack buffer, so drawing the prompt never allocates.
+    string_view currentDir = getcwd(cwd, sizeof(cwd)) ? cwd : "";
+    size_t mishDirPos = currentDir.find("/.mish");
+    if (mishDirPos != string::npos) {
+        // Only show the part of the path after '/.mish'
+        cout << "mish" << currentDir.substr(mishDirPos + 6) << "> ";
+    } else {
+        // Fall back to full path if for some reason we are outside the .mish directory
+        cout << "mish" << currentDir << "> ";
+    }
+    cout << flush;
 }
 
+string inputBuffer;         // Input read from stdin but not yet executed.
+size_t inputOffset = 0;     // Where the next line starts in inputBuffer.
+bool inputClosed = false;   // Set at end of input or when TMOUT expires.
 
-string checkWhiteSpaces(const string& input) {
-    string newInput;
-    const char* specialChars = "|<>&"; // Define special characters to format.
+/**
+ * Reads whatever is available on stdin and splits it into lines.
+ */
+void readInput() {
+    char buffer[4096];
+    ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) return;
+    if (n <= 0) {
+        inputClosed = true;
+        return;
+    }
+    if (inputOffset == inputBuffer.size()) { // Everything was consumed; reuse the buffer from the start.
+        inputBuffer.clear();
+        inputOffset = 0;
+    } else if (inputOffset > 0) {            // Move a partial line to the front, so the buffer stops growing.
+        inputBuffer.erase(0, inputOffset);
+        inputOffset = 0;
+    }
+    if (inputBuffer.capacity() < 2 * sizeof(buffer)) inputBuffer.reserve(2 * sizeof(buffer)); // A chunk after a partial line.
+    inputBuffer.append(buffer, n);
+}
 
-    for (size_t i = 0; i < input.length(); ++i) {
-        char current = input[i];
+/**
+ * Tells whether a complete line is waiting in inputBuffer.
+ */
+bool hasPendingLine() {
+    return inputBuffer.find('\n', inputOffset) != string::npos;
+}
 
-        // Check if the current character is special and needs spaces around it
-        if (strchr(specialChars, current)) {
-            // Add a space before the special character if it's not the first character and the previous character is not a space
-            if (i > 0 && !isspace(input[i - 1])) {
-                newInput += ' ';
-            }
-            newInput += current;
-            // Add a space after the special character if it's not the last character and the next character is not a space
-            if (i < input.length() - 1 && !isspace(input[i + 1])) {
-                newInput += ' ';
-            }
-        } else {
-            newInput += current;
+/**
+ * Returns the next command line. While waiting for one the event loop keeps running, so job
+ * notices and timers are handled even when the user is idle. In an interactive shell, a
+ * positive TMOUT logs out after that many idle seconds.
+ * @param line Receives the line, without its newline.
+ * @return false at end of input.
+ */
+bool readCommandLine(string& line) {
+    if (!hasPendingLine() && !inputClosed) {
+        bool pollable = watchFd(STDIN_FILENO, readInput); // Regular files cannot be polled; read them directly.
+        int timeoutTimer = -1;
+        const char* tmout = variableValue("TMOUT");
+        if (pollable && terminalFd != -1 && tmout && atof(tmout) > 0) {
+            timeoutTimer = addTimer(atof(tmout), false, []() {
+                cout << endl << "timed out waiting for input: auto-logout" << endl;
+                inputClosed = true;
+            });
         }
+        awaitingInput = true;
+        while (!hasPendingLine() && !inputClosed) {
+            if (pollable) runEventLoopOnce();
+            else readInput();
+        }
+        awaitingInput = false;
+        cancelTimer(timeoutTimer);
+        if (pollable) unwatchFd(STDIN_FILENO);
     }
-    return newInput;
+    if (inputOffset == inputBuffer.size()) return false;
+    size_t end = inputBuffer.find('\n', inputOffset);
+    if (end == string::npos) end = inputBuffer.size(); // A last line without a trailing newline.
+    line.assign(inputBuffer, inputOffset, end - inputOffset); // Reuses line's buffer.
+    inputOffset = min(end + 1, inputBuffer.size());
+    return true;
 }
 
 int main(int argc, char* argv[]) {
+    const char* spawnName = getenv("MISH_SPAWN"); // Lets batch hosts pick a launch backend without editing scripts.
+    if (spawnName && !parseSpawnBackend(spawnName, spawnBackend)) {
+        cerr << "mish: MISH_SPAWN: unknown spawn backend '" << spawnName << "'" << endl;
+    }
+
+    importEnvironment();
+    interactiveShell = argc == 1 && isatty(STDIN_FILENO);
+    initJobControl(interactiveShell);
 
     if (argc > 1) {
-        ifstream scriptFile(argv[1]);
+        // Read through a descriptor above the user's, so "exec 3<file" in the script can't replace it
+        int scriptFd = moveShellFd(open(argv[1], O_RDONLY | O_CLOEXEC));
+        FILE* scriptFile = scriptFd == -1 ? nullptr : fdopen(scriptFd, "r");
+        if (!scriptFile) {
+            cerr << "mish: " << argv[1] << ": " << strerror(errno) << endl;
+            return 127;
+        }
         string command;
-        while (getline(scriptFile, command)) {
-            // Process each line of the script here
-            auto tokens = tokenize(command);
-            if (!tokens.empty()) executeCommand(tokens);
+        Node* program;
+        char* line = nullptr;
+        size_t capacity = 0;
+        ssize_t length;
+        while ((length = getline(&line, &capacity, scriptFile)) != -1) {
+            reapChildren();
+            notifyFinishedJobs(); // Drops finished background jobs, silently in a script.
+            // Process each line of the script here, joining lines until the command is complete
+            if (length > 0 && line[length - 1] == '\n') length--;
+            command.append(line, length);
+            if (parseCommandLine(command, program) == ParseStatus::Incomplete) {
+                command += '\n';
+                continue;
+            }
+            lineInterrupted = false; // Ctrl-C skips the rest of its own line only.
+            if (program) runNode(program);
+            command.clear();
+            if (exitRequested) break;
         }
-        return 0;
+        free(line);
+        if (!command.empty()) {
+            cerr << "mish: syntax error: unexpected end of file" << endl;
+            lastExitStatus = 2;
+        }
+        releaseJobs();
+        return lastExitStatus;
     }
 
-    string homeDir = getenv("HOME") ? getenv("HOME")
-                                    : "."; // Tries to get the user's home directory from the environment variable. If not found, it defaults to the current directory (".").
+    string homeDir = variableValue("HOME") ? variableValue("HOME")
+                                           : "."; // Tries to get the user's home directory from the environment variable. If not found, it defaults to the current directory (".").
     string mishDir =
             homeDir + "/.mish"; // Constructs a path for a directory named ".mish" inside the user's home directory.
     mkdir(mishDir.c_str(),
@@ -442,88 +5923,36 @@ int main(int argc, char* argv[]) {
 
 
     // Command execution loop
-    string input;
+    string input, continuation;
     while (true) { // Enters an infinite loop to continuously accept commands from the user.
-        string currentDir = getCurrentDirectory();
-        size_t mishDirPos = currentDir.find("/.mish");
-        if (mishDirPos != string::npos) {
-            // Only show the part of the path after '/.mish'
-            cout << "mish" << currentDir.substr(mishDirPos + 6) << "> ";
-        } else {
-            // Fall back to full path if for some reason we are outside the .mish directory
-            cout << "mish" << currentDir << "> ";
-        }
+        reapChildren();
+        notifyFinishedJobs(); // Reports background jobs that completed since the last prompt.
+        printPrompt();
 
-        if(!getline(cin, input)) {
-            if(cin.eof()) {
-                cout << endl;
-                break;
-            }
-            else {
-                cin.clear();
-                continue;
-            }
+        if (!readCommandLine(input)) {
+            cout << endl;
+            break;
         }
 
-        //getline(cin, input); // Reads a line of input from the user.
-        if (input == "exit") break; // If the input command is "exit", breaks out of the loop to terminate the program.
-
-        input = checkWhiteSpaces(input);
-
-        auto tokens = tokenize(input);
-        if (tokens.empty()) continue; // If no tokens were found (empty input), skip the rest of the loop.
-
-
-        if (hasMultipleRedirectionsOrPipes(tokens)) {
-            continue;
+        Node* program;
+        ParseStatus parsed;
+        while ((parsed = parseCommandLine(input, program)) == ParseStatus::Incomplete) {
+            cout << "> " << flush; // The command goes on: an open quote, a trailing | or &&, an unclosed ( or {.
+            if (!readCommandLine(continuation)) break;
+            input += '\n';
+            input += continuation;
         }
-
-        if (hasSyntaxErrors(tokens)) continue;
-
-        if (isBackgroundCommand(input)) {
-            input.pop_back(); // Remove '&' from the end
-            executeCommandInBackground(tokens);
+        if (parsed == ParseStatus::Incomplete) {
+            cerr << "mish: syntax error: unexpected end of file" << endl;
+            lastExitStatus = 2;
+            break;
         }
 
-        int pipeIndex = findTokenIndex(tokens, "|");
-        int redirectOutIndex = findTokenIndex(tokens, ">");
-        int redirectInIndex = findTokenIndex(tokens, "<");
-        if (pipeIndex != -1) {
-            // The command contains a pipe
-            executePipedCommand(tokens);
-        } else if (redirectOutIndex != -1 || redirectInIndex != -1) {
-            // The command contains redirection
-            executeCommand(tokens); // This is your existing function that handles redirection
-        } else {
-
-            if (tokens[0] == "cd") { // If the first token is "cd", attempts to change the directory.
-                if (tokens.size() == 2) {
-                    if (chdir(tokens[1].c_str()) != 0) {
-                        perror("cd failed");
-                    }
-                } else {
-                    cerr << "Usage: cd <directory>" << endl;
-                }
-            } else if (tokens[0] == "ls" && tokens.size() == 2 && tokens[1] == "-al") {
-                // Specific handling for 'ls -al'
-                executeCommand(tokens);
-            } else if (tokens[0] == "ls") { // If the command is "ls", lists directories and files.
-                executeCommand(tokens);
-                // listDirectoriesAndFiles(tokens.size() > 1 ? tokens[1] : getCurrentDirectory()); // Passes a specific directory if provided, otherwise uses the current directory.
-            } else if (tokens[0] == "rm") { // Handles the "rm" command to remove files or directories.
-                // Further processing for "rm" command.
-            } else if (tokens[0] == "clear") {
-                write(STDOUT_FILENO, "\033[H\033[2J", 7);
-            } else if (tokens[0] == "emacs") {
-                executeCommand(tokens);
-            } else if (input.find('=') !=
-                       string::npos) { // Looks for variable assignment commands (e.g., "PATH=/usr/bin").
-                handleVariableAssignment(input); // Processes variable assignment.
-            } else {
-                executeCommand(tokens); // Executes the command specified by the tokens.
-            }
-        }
+        lineInterrupted = false;
+        if (program) runNode(program);
+        if (exitRequested) break;
     }
 
-    return 0;
+    releaseJobs();
+    return lastExitStatus;
 }
\ No newline at end of file
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Checks that ** does not search hidden directories, as the README and bash's globstar say,
+# while a pattern that starts with "." still matches them.
+# Usage: glob_hidden.sh path/to/MinesShell
+set -u
+mish=${1:?usage: $0 path/to/MinesShell}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir -p "$dir/src/x" "$dir/.git/x" "$dir/src/.cache/x"
+touch "$dir/src/x/config" "$dir/.git/x/config" "$dir/src/.cache/x/config"
+
+cat > "$dir/script" <<'SCRIPT'
+echo **/x/config
+echo **/config
+echo .*/x/config
+SCRIPT
+
+output=$(cd "$dir" && "$mish" script 2>&1)
+expected=$(printf 'src/x/config\nsrc/x/config\n.git/x/config')
+if [ "$output" != "$expected" ]; then
+    echo "FAIL: expected:"
+    echo "$expected"
+    echo "got:"
+    echo "$output"
+    exit 1
+fi
+echo "** skipped the hidden directories"
@@ -0,0 +1,61 @@
+/*
+ * An LD_PRELOAD shim that counts heap allocations. Every process that loads it appends
+ * "<pid> <allocations>" to the file named by MALLOC_COUNT_FILE when it exits normally, so a
+ * test can pick out the shell's own count from those of the programs it launched.
+ * Built by CMake for tests/zero_allocations.sh.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+static unsigned long allocations;
+
+static void tally(void) {
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+void* malloc(size_t size) {
+    tally();
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    tally();
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size) {
+    tally();
+    return __libc_realloc(pointer, size);
+}
+
+void* memalign(size_t alignment, size_t size) {
+    tally();
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size) {
+    *pointer = memalign(alignment, size);
+    return *pointer ? 0 : ENOMEM;
+}
+
+__attribute__((destructor)) static void report(void) {
+    unsigned long total = __atomic_load_n(&allocations, __ATOMIC_RELAXED); /* Before fopen adds its own. */
+    const char* path = getenv("MALLOC_COUNT_FILE");
+    if (!path) return;
+    FILE* file = fopen(path, "a");
+    if (!file) return;
+    fprintf(file, "%d %lu\n", (int) getpid(), total);
+    fclose(file);
+}
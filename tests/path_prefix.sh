@@ -0,0 +1,32 @@
+#!/bin/sh
+# Checks that a PATH prefix assignment decides where the command itself is found, not just
+# what the command sees, for simple commands, pipeline stages and command substitutions, and
+# that such lookups are not remembered in the shell's hash table.
+# Usage: path_prefix.sh path/to/MinesShell
+set -u
+mish=${1:?usage: $0 path/to/MinesShell}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/bin"
+printf '#!/bin/sh\necho hx ran\n' > "$dir/bin/hx"
+chmod +x "$dir/bin/hx"
+
+cat > "$dir/script" <<SCRIPT
+PATH=$dir/bin hx
+PATH=$dir/bin hx | cat
+echo \$(PATH=$dir/bin hx)
+hx
+echo \$?
+hash
+SCRIPT
+
+output=$("$mish" "$dir/script" 2>&1)
+expected=$(printf "hx ran\nhx ran\nhx ran\nmish: 'hx': No such file or directory\n127\nhash: hash table empty")
+if [ "$output" != "$expected" ]; then
+    echo "FAIL: expected:"
+    echo "$expected"
+    echo "got:"
+    echo "$output"
+    exit 1
+fi
+echo "PATH prefixes found the command"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Runs 500-stage pipelines through mish under small descriptor limits and checks that every
+# one completes with the right output and that the shell keeps running afterwards.
+# Usage: pipeline_fd_limit.sh path/to/MinesShell
+set -u
+mish=${1:?usage: $0 path/to/MinesShell}
+stages=500
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+# Builds "seq 1000 | <stage> | ... | wc -l" with the given stage repeated.
+pipeline() {
+    line="seq 1000"
+    i=0
+    while [ $i -lt $stages ]; do
+        line="$line | $1"
+        i=$((i + 1))
+    done
+    echo "$line | wc -l"
+}
+
+failures=0
+for limit in 20 64 256 4096; do
+    for launchers in "+o launchers" "-o launchers=8"; do
+        for stage in "tr 1 x" "cat" "( cat )"; do
+            {
+                echo "set $launchers"
+                pipeline "$stage"
+                echo 'echo status $?'
+            } > "$script"
+            output=$( (ulimit -n $limit && "$mish" "$script") 2>&1 | tr -d ' ')
+            expected=$(printf '1000\nstatus0')
+            if [ "$output" != "$expected" ]; then
+                echo "FAIL: ulimit -n $limit, set $launchers, stage '$stage':"
+                echo "$output" | head -5
+                failures=$((failures + 1))
+            fi
+        done
+    done
+done
+
+[ $failures -eq 0 ] && echo "all $stages-stage pipelines passed"
+exit $((failures != 0))
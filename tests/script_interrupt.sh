@@ -0,0 +1,26 @@
+#!/bin/sh
+# Checks that Ctrl-C in a script skips the rest of the interrupted line only: a foreground
+# command killed by SIGINT stops its own list, and the lines after it run as usual.
+# Usage: script_interrupt.sh path/to/MinesShell
+set -u
+mish=${1:?usage: $0 path/to/MinesShell}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+cat > "$script" <<'SCRIPT'
+sh -c 'kill -INT $$'; echo skipped
+echo one; echo two
+true && echo three
+false || echo four
+SCRIPT
+
+output=$("$mish" "$script" 2>&1)
+expected=$(printf '\none\ntwo\nthree\nfour')
+if [ "$output" != "$expected" ]; then
+    echo "FAIL: expected:"
+    echo "$expected"
+    echo "got:"
+    echo "$output"
+    exit 1
+fi
+echo "script continued after the interrupted line"
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Checks that "wait %n" in a script returns the status of a background job that finished
+# before the wait, and that the status is given out only once.
+# Usage: script_wait.sh path/to/MinesShell
+set -u
+mish=${1:?usage: $0 path/to/MinesShell}
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+cat > "$script" <<'SCRIPT'
+sh -c 'exit 5' &
+sh -c 'exit 6' &
+sleep 0.2
+true
+wait %2; echo $?
+wait %1; echo $?
+wait %1 2> /dev/null; echo $?
+SCRIPT
+
+output=$("$mish" "$script" 2>&1)
+expected=$(printf '6\n5\n127')
+if [ "$output" != "$expected" ]; then
+    echo "FAIL: expected:"
+    echo "$expected"
+    echo "got:"
+    echo "$output"
+    exit 1
+fi
+echo "wait found the finished jobs"
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Checks that a warmed-up shell runs simple commands without heap allocations in the parent.
+# Each command line is run N and then 2N times, read from a script file and from standard
+# input, with the malloc_count shim preloaded. The shell's own count must not grow with N.
+# Usage: zero_allocations.sh path/to/MinesShell path/to/libmalloc_count.so
+set -u
+mish=${1:?usage: $0 path/to/MinesShell path/to/libmalloc_count.so}
+shim=${2:?usage: $0 path/to/MinesShell path/to/libmalloc_count.so}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+lines=1000
+
+# Prints the parent shell's allocation count for a script of the given line repeated n times.
+count() {
+    yes "$1" | head -n "$2" > "$dir/script"
+    rm -f "$dir/counts"
+    if [ "$3" = file ]; then
+        sh -c 'echo $$ > "$1/pid"; exec env LD_PRELOAD="$2" MALLOC_COUNT_FILE="$1/counts" "$3" "$1/script"' \
+            sh "$dir" "$shim" "$mish" > /dev/null 2>&1
+    else
+        sh -c 'echo $$ > "$1/pid"; exec env LD_PRELOAD="$2" MALLOC_COUNT_FILE="$1/counts" "$3" < "$1/script"' \
+            sh "$dir" "$shim" "$mish" > /dev/null 2>&1
+    fi
+    awk -v pid="$(cat "$dir/pid")" '$1 == pid { print $2 }' "$dir/counts"
+}
+
+failures=0
+for mode in file stdin; do
+    for line in '/bin/true' 'echo hello world' 'x=1' 'true && false || pwd' 'echo $? > /dev/null' 'cd .'; do
+        once=$(count "$line" $lines $mode)
+        twice=$(count "$line" $((lines * 2)) $mode)
+        if [ -z "$once" ] || [ "$once" != "$twice" ]; then
+            echo "FAIL ($mode): '$line' made ${once:-?} allocations in $lines lines, ${twice:-?} in $((lines * 2))"
+            failures=$((failures + 1))
+        fi
+    done
+done
+
+[ $failures -eq 0 ] && echo "no allocations per line once warmed up"
+exit $((failures != 0))